@@ -2,14 +2,169 @@
 #define _SLKQ_COMMON_H_
 #define DEBUG
 
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
 #define SLKQ_NAME "slkq"
 #define SLKQ_DEV "/dev/slkq"
-#define SLKQ_SPOOL_FILENAME "/var/spool/slkq.dat"
+#define SLKQ_SPOOL_PREFIX "/var/spool/slkq" /* segments are <prefix>.<seq>.dat */
 #define SLKQ_PROC_STATUS_FILENAME "slkq_status"
 #define SLKQ_MSG_MAX_SIZE (0x10000) /* 65536 */
 #define SLKQ_READER_LOCK "/var/lock/slkq_reader.lock"
 #define SLKQ_READER_OUTPUT_DIR "/var/cache/slkq"
 #define SLKQ_READER_LOG "/var/log/slkq_reader.log"
 
+/**
+ * ioctl() commands for /dev/slkq, mode is set per open file
+ *
+ * SLKQ_MODE_SINGLE (default): one message per read()/write()
+ * SLKQ_MODE_BATCH: read()/write() buffer holds sequence of records, each
+ * record is two-byte length (host byte order) followed by message itself.
+ * write() pushes as many records as fit into queue, read() pops as many
+ * whole records as fit into buffer.
+ */
+#define SLKQ_IOC_MAGIC 'q'
+#define SLKQ_IOC_SET_MODE _IOW(SLKQ_IOC_MAGIC, 1, int)
+#define SLKQ_IOC_GET_MODE _IOR(SLKQ_IOC_MAGIC, 2, int)
+
+#define SLKQ_MODE_SINGLE 0
+#define SLKQ_MODE_BATCH 1
+
+#define SLKQ_REC_HDR_SIZE 2
+
+/**
+ * Shared memory rings (per open file), set up by SLKQ_IOC_RING_SETUP and
+ * mapped by mmap() at offset 0:
+ *
+ * - struct slkq_ring_ctl at the beginning of mapping (page 0)
+ * - 'push' ring at push_off: user produces (push_tail), kernel consumes
+ *   (push_head) on SLKQ_IOC_RING_PUSH
+ * - 'pop' ring at pop_off: kernel produces (pop_tail) on SLKQ_IOC_RING_POP,
+ *   user consumes (pop_head)
+ *
+ * Both rings have 'slots' (power of 2) slots of 'slot_size' bytes, slot is
+ * record (two-byte length and message) same as in SLKQ_MODE_BATCH. Indices
+ * are free running, slot is at index & (slots - 1). Producer must store
+ * slot before releasing index (store-release), consumer must load index with
+ * load-acquire.
+ *
+ * SLKQ_IOC_RING_PUSH/SLKQ_IOC_RING_POP return number of messages moved.
+ * Message that doesn't fit into pop ring slot makes SLKQ_IOC_RING_POP fail
+ * with EMSGSIZE, it has to be read() then.
+ *
+ * With SLKQ_RING_POLL_PUSH in 'flags' kernel consumes push ring on its own:
+ * it polls push_tail while producer keeps it busy, and after ring_idle_ms
+ * (module parameter) without new messages (or once queue is full) sets
+ * SLKQ_RING_NEED_WAKEUP in push_flags and stops. Producer loads push_flags
+ * after releasing push_tail (with full barrier in between) and calls
+ * SLKQ_IOC_RING_PUSH if the flag is set, which restarts polling.
+ *
+ * With SLKQ_RING_POLL_POP kernel fills pop ring as messages arrive, poll()
+ * reports POLLIN while pop ring isn't empty. Once the ring is full (and
+ * queue still isn't empty) kernel sets SLKQ_RING_NEED_WAKEUP in pop_flags,
+ * consumer loads pop_flags after releasing pop_head (with full barrier in
+ * between) and calls SLKQ_IOC_RING_POP if the flag is set.
+ */
+#define SLKQ_IOC_RING_SETUP _IOWR(SLKQ_IOC_MAGIC, 3, struct slkq_ring_params)
+#define SLKQ_IOC_RING_PUSH _IO(SLKQ_IOC_MAGIC, 4)
+#define SLKQ_IOC_RING_POP _IO(SLKQ_IOC_MAGIC, 5)
+
+#define SLKQ_RING_SLOTS_MAX 4096
+#define SLKQ_RING_SIZE_MAX (64 * 1024 * 1024)
+
+/* slkq_ring_params flags */
+#define SLKQ_RING_POLL_PUSH 0x1
+#define SLKQ_RING_POLL_POP 0x2
+
+/* slkq_ring_ctl push_flags/pop_flags */
+#define SLKQ_RING_NEED_WAKEUP 0x1
+
+struct slkq_ring_params {
+	__u32 slots;            /* in: number of slots, power of 2 */
+	__u32 slot_size;        /* in: slot size, rounded up to 8 bytes */
+	__u32 push_off;         /* out: offset of push ring */
+	__u32 pop_off;          /* out: offset of pop ring */
+	__u32 size;             /* out: size to mmap() */
+	__u32 flags;            /* in: SLKQ_RING_POLL_* */
+};
+
+struct slkq_ring_ctl {
+	__u32 push_head;        /* kernel */
+	__u32 push_flags;       /* kernel */
+	__u32 pad0[14];
+	__u32 push_tail;        /* user */
+	__u32 pad1[15];
+	__u32 pop_head;         /* user */
+	__u32 pad2[15];
+	__u32 pop_tail;         /* kernel */
+	__u32 pop_flags;        /* kernel */
+	__u32 pad3[14];
+};
+
+/**
+ * Named queues: besides default queue (/dev/slkq) there can be up to
+ * SLKQ_QUEUES_MAX - 1 others, each one with its own FIFO and spool. Queue
+ * <name> is /dev/slkq-<name>, its spool is SLKQ_SPOOL_PREFIX-<name>.* and
+ * status is /proc/slkq_status-<name>.
+ *
+ * SLKQ_IOC_QUEUE_CREATE/SLKQ_IOC_QUEUE_DESTROY are issued on /dev/slkq and
+ * need CAP_SYS_ADMIN. Name is up to SLKQ_QUEUE_NAME_MAX - 1 characters of
+ * [A-Za-z0-9_-], queue that is open can't be destroyed (EBUSY). Spool is
+ * kept on destroy and is picked up by queue created with the same name.
+ *
+ * Queue can have up to SLKQ_PARTITIONS_MAX partitions ('partitions', 0 means
+ * 1, ignored on destroy), each one with its own FIFO, locks and spool
+ * (<spool prefix>.p<n>.* for n > 0). Partitioned queue is still single
+ * device:
+ *
+ * - write() (or SLKQ_IOC_RING_PUSH) goes to single partition, picked by key
+ *   set on file by SLKQ_IOC_SET_KEY, round robin if file has no key. Order
+ *   is kept within partition only.
+ * - SLKQ_IOC_GROUP_JOIN makes file member of queue's consumer group: member
+ *   k of n reads partitions i with i % n == k only, group is rebalanced once
+ *   member closes its file. Files that didn't join read all partitions.
+ *
+ * 'flags' of SLKQ_IOC_QUEUE_CREATE:
+ *
+ * - SLKQ_QUEUE_COMPRESS: spool is written as LZ4 compressed frames (spool
+ *   written with and without it is read either way)
+ */
+#define SLKQ_QUEUES_MAX 64
+#define SLKQ_QUEUE_NAME_MAX 32
+#define SLKQ_PARTITIONS_MAX 64
+
+#define SLKQ_QUEUE_COMPRESS 0x1
+
+#define SLKQ_IOC_QUEUE_CREATE _IOW(SLKQ_IOC_MAGIC, 6, struct slkq_queue_params)
+#define SLKQ_IOC_QUEUE_DESTROY _IOW(SLKQ_IOC_MAGIC, 7, struct slkq_queue_params)
+#define SLKQ_IOC_SET_KEY _IOW(SLKQ_IOC_MAGIC, 8, __u32)
+#define SLKQ_IOC_GROUP_JOIN _IO(SLKQ_IOC_MAGIC, 9)
+
+/**
+ * Full queue policy, i.e. what happens to message that doesn't fit into
+ * queue's in-kernel FIFO. Set per queue by SLKQ_IOC_SET_FULL_POLICY on its
+ * device (needs CAP_SYS_ADMIN):
+ *
+ * - SLKQ_FULL_SPOOL (default): message goes to spool, written out by
+ *   producer if spool staging buffer is full
+ * - SLKQ_FULL_BLOCK: producer sleeps till readers make room (EAGAIN for
+ *   O_NONBLOCK file and for SLKQ_IOC_RING_PUSH, poll() for POLLOUT)
+ * - SLKQ_FULL_DROP_OLDEST: oldest message in FIFO is dropped
+ * - SLKQ_FULL_DROP_NEWEST: message is dropped (write() still succeeds)
+ */
+#define SLKQ_IOC_SET_FULL_POLICY _IOW(SLKQ_IOC_MAGIC, 10, int)
+#define SLKQ_IOC_GET_FULL_POLICY _IOR(SLKQ_IOC_MAGIC, 11, int)
+
+#define SLKQ_FULL_SPOOL 0
+#define SLKQ_FULL_BLOCK 1
+#define SLKQ_FULL_DROP_OLDEST 2
+#define SLKQ_FULL_DROP_NEWEST 3
+
+struct slkq_queue_params {
+	char name[SLKQ_QUEUE_NAME_MAX];
+	__u32 partitions;
+	__u32 flags;            /* SLKQ_QUEUE_*, ignored on destroy */
+};
+
 
 #endif
\ No newline at end of file
@@ -24,7 +24,6 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/kfifo.h>
-#include <linux/kthread.h>
 #include <linux/mutex.h>
 #include <linux/unistd.h>
 #include <linux/fs.h>
@@ -36,6 +35,27 @@
 #include <linux/slab.h>
 #include <linux/proc_fs.h>
 #include <linux/atomic.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/crc32c.h>
+#include <linux/idr.h>
+#include <linux/ctype.h>
+#include <linux/capability.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/workqueue.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alexey Mikhailov <alexey.mikhailov@gmail.com>");
@@ -43,561 +63,4107 @@ MODULE_DESCRIPTION("Simple Linux Kernel Queue");
 MODULE_VERSION("0.1");
 
 /**
- * In-kernel FIFO queue being maintained with spool using on-disk file
- * as backing device. Interaction between in-kernel spool and external stoarge can
- * be described in simple way.  There is kernel thread serving such interaction,
- * it wakes up (waitqueue) in following cases:
+ * Queue consists of two segments: head is in-kernel FIFO, tail is spool (on-disk
+ * file plus staging buffer of records not written out yet). Messages are pushed
+ * to FIFO while spool is empty, once FIFO is full (or spool isn't empty) they are
+ * appended to spool instead. Messages are popped from FIFO only, spool is
+ * streamed back into FIFO in order as it drains, so queue is strict FIFO.
  *
- * - On 'push': kernel FIFO becomes full after enquing message (slkq_dev_write)
- * - On 'pop': kernel FIFO has enough space to accommodate more elements and on-disk
- *   spool is not empty after dequing message (slkq_dev_read)
+ * FIFO <=> spool interaction is served by work items of each queue
+ * (partition) on unbound workqueue (slkq_spool_wq), they get queued in
+ * following cases:
  *
- * This behavior is controlled by constants defined below:
+ * - On 'push': message got appended to staging buffer
+ *   (slkq_dev_write_iter), flush work writes it out
+ * - On 'pop': kernel FIFO has enough space to accommodate more elements and
+ *   spool is not empty after dequing message (slkq_dev_read_iter), load
+ *   work streams spool back into FIFO
+ *
+ * Neither of them does disk I/O on behalf of readers or writers, and
+ * writes to spool go with q->in_fifo_lock released, so producers keep
+ * pushing while flush work waits for disk. Sync work makes spool durable
+ * as per 'spool_sync' policy.
+ *
+ * This behavior is controlled by values defined below:
  *
- * - SLKQ_FIFO_SHRINK_TO: number of elements (length) that FIFO gets shrinked to when overfulls
  * - SLKQ_FIFO_EXTEND_(LIMIT|TO):  if queue length is lower than SLKQ_FIFO_EXTEND_LIMIT and
- *   on-disk spool is not empty, queue gets populated from spool (to SLKQ_FIFO_EXTEND_TO
+ *   spool is not empty, queue gets populated from spool (to SLKQ_FIFO_EXTEND_TO
  *   elements at max)
+ *
+ * FIFO capacity and these thresholds are module parameters ('fifo_length',
+ * 'extend_limit', 'extend_to'), they can be given to insmod or
+ * changed at runtime through /sys/module/slkq/parameters/. Zero threshold
+ * means default (fraction of FIFO capacity).
  */
 
-#define SLKQ_FIFO_LENGTH 1024
+#define SLKQ_FIFO_LENGTH_DEFAULT 1024
+#define SLKQ_FIFO_LENGTH_MAX (1 << 20)
 
 struct slkq_fifo_msg {
 	u_int16_t size;
 	unsigned char *buf;
+	u64 ts;                 /* enqueue time, ns, 0 if it went through spool */
+};
+
+static unsigned int fifo_length = SLKQ_FIFO_LENGTH_DEFAULT;
+static unsigned int fifo_extend_limit;
+static unsigned int fifo_extend_to;
+
+#define SLKQ_FIFO_LENGTH(q) (kfifo_size(&(q)->msg_fifo))
+#define SLKQ_FIFO_EXTEND_LIMIT(q)					\
+	(fifo_extend_limit ? fifo_extend_limit : (SLKQ_FIFO_LENGTH(q) * 1) / 2)
+#define SLKQ_FIFO_EXTEND_TO(q)						\
+	(fifo_extend_to ? fifo_extend_to : (SLKQ_FIFO_LENGTH(q) * 3) / 4)
+#define SLKQ_FIFO_EXTEND_COND(q)				   \
+	((kfifo_len(&(q)->msg_fifo) <= SLKQ_FIFO_EXTEND_LIMIT(q))   \
+	 && (atomic_read(&(q)->spool_size) > 0))
+
+#define SLKQ_SPOOL_FLUSH_COND(q) ((q)->spool_wbuf_used > (q)->spool_wbuf_head)
+
+/**
+ * On-disk spool is split into segment files (<prefix>.<seq>.dat) of
+ * 'spool_seg_size' bytes at most, records never cross segment boundary. Data
+ * is appended to tail segment, new one (with space preallocated) is started
+ * once it's full. Head segment is read from the beginning, spool_pos being
+ * its read offset, and it gets unlinked once it's consumed, so reclamation
+ * costs single unlink on any filesystem.
+ *
+ * Spool record is two-byte length, CRC32C of message and message itself.
+ * Spool survives module reload and reboot: checkpoint file
+ * (<prefix>.ckpt) holds head segment and read offset, on load
+ * spool is validated from there on (i.e. only unconsumed part of it), up to
+ * first torn or corrupted record. Checkpoint follows loading of FIFO, so
+ * messages that were in FIFO are lost on crash (as are ones which never got
+ * to spool); on module unload FIFO is saved to segment preceding head one.
+ */
+
+#define SLKQ_SPOOL_SEG_SIZE_DEFAULT (16 * 1024 * 1024)
+#define SLKQ_SPOOL_REC_HDR_SIZE 6 /* u16 length, u32 crc32c */
+#define SLKQ_SPOOL_SEG_SIZE_MIN (SLKQ_MSG_MAX_SIZE + SLKQ_SPOOL_REC_HDR_SIZE)
+/* first segment of new spool, leaves room for ones prepended on unload */
+#define SLKQ_SPOOL_SEQ_BASE (1ULL << 32)
+
+#define SLKQ_SPOOL_CKPT_MAGIC 0x736c6b71 /* "slkq" */
+
+struct slkq_spool_ckpt {
+	u32 magic;
+	u32 version;
+	u64 head_seq;
+	u64 head_pos;
+	u32 head_skip;          /* records of frame at head_pos consumed */
+	u32 crc;                /* crc32c of fields above */
+};
+
+/**
+ * Spool of queue created with SLKQ_QUEUE_COMPRESS (default queue:
+ * 'spool_compress' parameter) is LZ4 compressed: each write out of staging
+ * buffer becomes frame, struct slkq_spool_frame followed by LZ4 block of
+ * records as they are in staging buffer. Frame header starts as record of
+ * zero length with SLKQ_SPOOL_FRAME_MAGIC in place of CRC (CRC of empty
+ * record is ~0), so frames and plain records can follow each other in
+ * segment. Frame never spans segments, records are written as they are if
+ * frame isn't smaller. Frame being loaded is decompressed into
+ * spool_zbuf, checkpoint keeps number of its records consumed.
+ */
+#define SLKQ_SPOOL_FRAME_MAGIC 0x736c6b7a /* "slkz" */
+
+struct slkq_spool_frame {
+	u16 zero;               /* record length */
+	u32 magic;              /* record CRC */
+	u32 clen;               /* compressed length */
+	u32 rlen;               /* length of records */
+	u32 n;                  /* number of records */
+	u32 crc;                /* crc32c of compressed data */
+} __packed;
+
+#define SLKQ_SPOOL_FRAME_HDR_SIZE sizeof(struct slkq_spool_frame)
+
+static bool spool_compress;
+module_param(spool_compress, bool, 0444);
+MODULE_PARM_DESC(spool_compress, "LZ4 compression of default queue's spool (default: N)");
+
+static unsigned int spool_seg_size = SLKQ_SPOOL_SEG_SIZE_DEFAULT;
+module_param(spool_seg_size, uint, 0444);
+MODULE_PARM_DESC(spool_seg_size, "spool segment file size, bytes (default: 16 MiB)");
+
+/**
+ * Messages appended to spool are serialized into page-aligned staging buffer
+ * of SLKQ_SPOOL_WBUF_SIZE bytes which is written out at once (group commit).
+ * Records in staging buffer are spool's newest ones, [spool_wbuf_head,
+ * spool_wbuf_used) are not consumed yet. Flush work takes whole buffer
+ * over (spool_fbuf) and writes it out while writers fill the other one,
+ * push waits (or gets -EAGAIN) only if both are full. Spool file isn't
+ * opened O_SYNC, durability is controlled by 'spool_sync' parameter:
+ *
+ * - none: rely on page cache writeback
+ * - batch: fdatasync after each write out (default)
+ * - time: fdatasync at most once per 'spool_sync_ms' milliseconds
+ */
+#define SLKQ_SPOOL_WBUF_SIZE (1024 * 1024)
+
+enum {
+	SLKQ_SPOOL_SYNC_NONE,
+	SLKQ_SPOOL_SYNC_BATCH,
+	SLKQ_SPOOL_SYNC_TIME,
+};
+
+static const char * const spool_sync_names[] = {
+	[SLKQ_SPOOL_SYNC_NONE] = "none",
+	[SLKQ_SPOOL_SYNC_BATCH] = "batch",
+	[SLKQ_SPOOL_SYNC_TIME] = "time",
+};
+
+static int spool_sync = SLKQ_SPOOL_SYNC_BATCH;
+static unsigned int spool_sync_ms = 1000;
+
+/**
+ * Loading goes through pair of SLKQ_SPOOL_RBUF_SIZE read buffers: records are
+ * parsed out of current one, while the other one gets chunk that follows
+ * prefetched by load work once FIFO is loaded (double buffering).
+ *
+ * Records are parsed with queue lock released, SLKQ_SPOOL_LOAD_BATCH at most
+ * at a time, and put into FIFO under it.
+ */
+#define SLKQ_SPOOL_RBUF_SIZE (1024 * 1024)
+#define SLKQ_SPOOL_LOAD_BATCH 256
+
+struct slkq_spool_rbuf {
+	unsigned char *buf;
+	loff_t off;             /* spool offset of buf[0] */
+	size_t len;             /* valid bytes, 0 if empty */
+};
+
+/**
+ * Statistics are per-CPU counters of each queue (partition), updated with
+ * this_cpu_*() ops and summed up without any locks on read, so monitoring
+ * doesn't touch hot path. They are exposed through debugfs:
+ *
+ * /sys/kernel/debug/slkq/<queue>/stats -- "name value" lines
+ * /sys/kernel/debug/slkq/<queue>/histograms -- log2 histograms in usecs:
+ *   residence (enqueue to dequeue, messages that bypassed spool only) and
+ *   flush (staging buffer write out duration)
+ *
+ * Partitioned queue shows sums over partitions.
+ */
+#define SLKQ_HIST_BUCKETS 32
+
+/* all fields are u64 counters, they're summed as array (slkq_stats_sum) */
+struct slkq_stats {
+	u64 enq;
+	u64 enq_bytes;
+	u64 deq;
+	u64 deq_bytes;
+	u64 spill;              /* messages appended to spool */
+	u64 spill_bytes;
+	u64 load;               /* messages loaded from spool */
+	u64 load_bytes;
+	u64 flush;              /* staging buffer write outs */
+	u64 flush_bytes;
+	u64 seg_reclaim;        /* consumed segments unlinked */
+	u64 compress_in;        /* bytes of records written as frames */
+	u64 compress_out;       /* bytes of frames */
+	u64 compress_ns;
+	u64 decompress_ns;
+	u64 in_contended;       /* writers found in_fifo_lock taken */
+	u64 out_contended;      /* readers found out_fifo_lock taken */
+	u64 write_blocked_ns;   /* writers waiting for in_fifo_lock */
+	u64 read_blocked_ns;    /* readers waiting for messages */
+	u64 drop_oldest;        /* messages dropped by full queue policy */
+	u64 drop_newest;
+	u64 residence[SLKQ_HIST_BUCKETS];
+	u64 flush_lat[SLKQ_HIST_BUCKETS];
+};
+
+#define SLKQ_STAT_ADD(q, field, v) this_cpu_add((q)->stats->field, (v))
+#define SLKQ_STAT_INC(q, field) this_cpu_inc((q)->stats->field)
+
+/* slkq_hist_bucket -- bucket 0 is < 1 usec, bucket b is [2^(b-1), 2^b) usecs */
+static inline unsigned int slkq_hist_bucket (u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	return min_t(unsigned int, fls64(us), SLKQ_HIST_BUCKETS - 1);
+}
+
+static struct dentry *slkq_dbg_root;
+
+/**
+ * Per-CPU staging (optional, 'stage_length' parameter): writers copy message
+ * in without taking in_fifo_lock and put it into ring of CPU they run on
+ * (with preemption disabled, so each ring has single producer). Whoever
+ * holds in_fifo_lock drains rings into queue (__stage_drain) before letting
+ * it go (slkq_in_unlock), writer that finds lock free drains itself. Writer
+ * falls back to locked path once its ring is full.
+ *
+ * Messages of different producers are no longer pushed in order they were
+ * written. Order of each open file is kept while 'stage_ordered' is set:
+ * writer that migrated to another CPU while its previous CPU's ring isn't
+ * drained yet takes locked path, which drains everything first.
+ */
+struct slkq_stage {
+	DECLARE_KFIFO_PTR(fifo, struct slkq_fifo_msg);
+};
+
+static unsigned int stage_length;
+module_param(stage_length, uint, 0444);
+MODULE_PARM_DESC(stage_length, "per-CPU staging ring capacity, load time only (default: 0, no staging)");
+static bool stage_ordered = true;
+module_param(stage_ordered, bool, 0644);
+MODULE_PARM_DESC(stage_ordered, "keep order of messages written through each open file (default: Y)");
+
+/**
+ * There are multiple independent queues, each one has its own FIFO, locks,
+ * spool (SLKQ_SPOOL_PREFIX-<name>.*), spool work items, character device
+ * (/dev/slkq-<name>) and status entry (/proc/slkq_status-<name>). Default
+ * queue (SLKQ_NAME) is always there and uses names without suffix, other
+ * ones are created and destroyed by SLKQ_IOC_QUEUE_(CREATE|DESTROY) ioctl
+ * on it. Parameters apply to all queues.
+ *
+ * Queue can be split into partitions (SLKQ_PARTITIONS_MAX at most), each
+ * partition is struct slkq_queue of its own (FIFO, locks, spool
+ * <prefix>.p<n>.*, spool work items) except for device and status entry, queue
+ * itself is partition 0. write() goes to partition picked by file's key
+ * (SLKQ_IOC_SET_KEY) or round robin. Readers that joined consumer group
+ * (SLKQ_IOC_GROUP_JOIN) get partitions assigned (member k of n reads
+ * partitions i with i % n == k), so they don't share out_fifo_lock, group
+ * gets rebalanced once member closes its file. Other readers read all
+ * partitions. Readers and writers of all partitions wait on queue's
+ * msg_new_q/msg_space_q.
+ */
+struct slkq_queue {
+	char name[SLKQ_QUEUE_NAME_MAX];
+	char prefix[64];             /* spool files */
+	char status_name[64];        /* /proc entry */
+	int minor;
+	int users;                   /* open files, under slkq_queues_lock */
+
+	DECLARE_KFIFO_PTR(msg_fifo, struct slkq_fifo_msg);
+
+	wait_queue_head_t msg_new_q;   /* (dev_write && NEW) => dev_read unblocks  */
+	wait_queue_head_t msg_space_q; /* dev_read || spool flush => writers waiting
+					  in poll() wake */
+
+	struct mutex in_fifo_lock;
+	struct mutex out_fifo_lock;
+
+	struct file *spool_head_f;   /* segment being read */
+	struct file *spool_tail_f;   /* segment being written, same as head if seqs match */
+	u64 spool_head_seq;
+	u64 spool_tail_seq;
+	loff_t spool_tail_size;
+	struct file *spool_ckpt_f;
+	bool spool_ckpt_dirty;
+	atomic_t spool_size;         /* records in spool (file + in flight + staging) */
+	unsigned int spool_disk_n;   /* records in spool file */
+	loff_t spool_pos;            /* loader's read offset */
+	loff_t spool_done_pos;       /* spool_pos of records in FIFO */
+	unsigned int spool_done_skip; /* spool_zskip of records in FIFO */
+	struct mutex spool_load_lock; /* loader's read state, FIFO capacity */
+	struct slkq_fifo_msg *spool_lmsg; /* records being loaded */
+	struct mutex spool_ckpt_lock; /* checkpoint file */
+	u64 spool_ckpt_seq;          /* head segment checkpoint points to */
+
+	char *spool_wbuf;
+	size_t spool_wbuf_head;
+	size_t spool_wbuf_used;
+	unsigned int spool_wbuf_n;   /* records in staging buffer */
+	char *spool_fbuf;            /* staging buffer being written out */
+	size_t spool_fbuf_head;
+	size_t spool_fbuf_used;
+	unsigned int spool_fbuf_n;   /* records in flight, 0 if flush is idle */
+	bool spool_dirty;
+
+	struct delayed_work spool_load_work;
+	struct delayed_work spool_flush_work;
+	struct delayed_work spool_sync_work;
+	bool spool_stopping;         /* no more work gets queued */
+
+	struct slkq_spool_rbuf spool_rbuf[2];
+	unsigned int spool_rbuf_cur;
+
+	bool spool_compress;
+	char *spool_cbuf;            /* frame being written out */
+	void *spool_lz4_wrk;
+	unsigned char *spool_zbuf;   /* records of frame being loaded */
+	size_t spool_zlen;           /* 0 if there is no frame being loaded */
+	size_t spool_zpos;
+	size_t spool_zframe;         /* frame size in spool */
+	unsigned int spool_zskip;    /* records of frame at spool_pos consumed */
+
+	struct slkq_stage __percpu *stage; /* NULL if staging is off */
+	struct slkq_stats __percpu *stats;
+	struct dentry *dbg_dir;
+
+	struct slkq_queue *parent;   /* queue partition belongs to, self for queue */
+	struct slkq_queue **parts;   /* partitions, parts[0] is queue itself */
+	unsigned int nparts;
+	atomic_t rr;                 /* round robin routing */
+
+	int full_policy;             /* SLKQ_FULL_*, of queue (not partition) */
+
+	struct mutex group_lock;     /* consumer group */
+	struct list_head members;
+	unsigned int nmembers;
+
+	struct device *devp;
+	struct cdev *cdev;
+	struct proc_dir_entry *status_ent;
 };
 
-DECLARE_KFIFO(msg_fifo, struct slkq_fifo_msg, SLKQ_FIFO_LENGTH);
+static struct workqueue_struct *slkq_spool_wq;
+
+/* slkq_spool_queue -- queues spool work of 'q' unless it's going away */
+static inline void slkq_spool_queue (struct slkq_queue *q, struct delayed_work *dw,
+				     unsigned long delay)
+{
+	if (!READ_ONCE(q->spool_stopping))
+		queue_delayed_work(slkq_spool_wq, dw, delay);
+}
 
-#define SLKQ_FIFO_EXTEND_LIMIT ((SLKQ_FIFO_LENGTH * 1) / 2)
-#define SLKQ_FIFO_EXTEND_TO ((SLKQ_FIFO_LENGTH * 3) / 4)
-#define SLKQ_FIFO_EXTEND_COND()					   \
-	((kfifo_len(&msg_fifo) <= SLKQ_FIFO_EXTEND_LIMIT)	   \
-	 && (atomic_read(&spool_size) > 0))
+/* slkq_spool_kick -- queues load and flush of 'q' as its state asks for */
+static void slkq_spool_kick (struct slkq_queue *q)
+{
+	if (SLKQ_FIFO_EXTEND_COND(q))
+		slkq_spool_queue(q, &q->spool_load_work, 0);
 
-#define SLKQ_FIFO_SHRINK_TO ((SLKQ_FIFO_LENGTH * 3) / 4)
+	if (SLKQ_SPOOL_FLUSH_COND(q))
+		slkq_spool_queue(q, &q->spool_flush_work, 0);
+}
 
 /**
- * This module uses single on-disk file as queue spool. File gets extended as data
- * being pushed. File being read from the beginning while extracting (popping) data out,
- * pointer (offset) being maintained/used for this. This scheme has obvious disadvatange:
- * on-disk spool will keep growing. To eliminate this issue, FALLOC_FL_COLLAPSE_RANGE
- * being used (refer to fallocate(2)). SLKQ_SPOOL_COLLAPSE_LIMIT defines threshold
- * which is used to decide when to "cut" the beginning of file. So collapse happens
- * when offset becomes greater than threshold value.
+ * slkq_spool_sync_kick -- queues sync of what's written and loaded, 'time'
+ * policy defers it by 'spool_sync_ms' (pending sync isn't moved)
  *
- * It must be noted that FALLOC_FL_COLLAPSE_RANGE is currently only supported
- * by ext4 and XFS filesystem (see fallocate(2)).
+ * Must be called with q->in_fifo_lock down
+ */
+static void slkq_spool_sync_kick (struct slkq_queue *q)
+{
+	if (!q->spool_dirty && !q->spool_ckpt_dirty)
+		return;
+
+	slkq_spool_queue(q, &q->spool_sync_work,
+			 (spool_sync == SLKQ_SPOOL_SYNC_TIME) ?
+			 (msecs_to_jiffies(spool_sync_ms)) : (0));
+}
+
+/* queues by minor number, changes and lookups are under slkq_queues_lock */
+static DEFINE_IDR(slkq_queues);
+static DEFINE_MUTEX(slkq_queues_lock);
+
+static unsigned int partitions = 1;
+module_param(partitions, uint, 0444);
+MODULE_PARM_DESC(partitions, "number of partitions of default queue (default: 1)");
+
+/**
+ * Full queue policy (SLKQ_FULL_*, see common/slkq.h) is set per queue by
+ * SLKQ_IOC_SET_FULL_POLICY, 'full_policy' parameter is what queues start
+ * with. It applies when message doesn't fit into FIFO and spool is empty,
+ * spool that isn't (e.g. left by previous run) still gets new messages, so
+ * order is kept.
+ */
+static const char * const full_policy_names[] = {
+	[SLKQ_FULL_SPOOL] = "spool",
+	[SLKQ_FULL_BLOCK] = "block",
+	[SLKQ_FULL_DROP_OLDEST] = "drop_oldest",
+	[SLKQ_FULL_DROP_NEWEST] = "drop_newest",
+};
+
+static int full_policy = SLKQ_FULL_SPOOL;
+
+static int slkq_param_set_policy (const char *val,
+				  const struct kernel_param *kp)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(full_policy_names); i++) {
+		if (sysfs_streq(val, full_policy_names[i])) {
+			full_policy = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int slkq_param_get_policy (char *buf, const struct kernel_param *kp)
+{
+	return sprintf(buf, "%s\n", full_policy_names[full_policy]);
+}
+
+static const struct kernel_param_ops slkq_policy_ops = {
+	.set = slkq_param_set_policy,
+	.get = slkq_param_get_policy,
+};
+
+module_param_cb(full_policy, &slkq_policy_ops, &full_policy, 0644);
+MODULE_PARM_DESC(full_policy, "full queue policy of new queues: spool, block, drop_oldest or drop_newest (default: spool)");
+
+static inline int slkq_full_policy (struct slkq_queue *q)
+{
+	return READ_ONCE(q->parent->full_policy);
+}
+
+/**
+ * slab allocator is used for in-kernel queue elements (messages). There is
+ * cache per power-of-two size class (64 bytes .. SLKQ_MSG_MAX_SIZE), so memory
+ * held by queue follows actual payload size rather than maximum one.
  */
+#define SLKQ_MSG_CLASS_MIN_SHIFT 6
+#define SLKQ_MSG_CLASS_MAX_SHIFT 16 /* SLKQ_MSG_MAX_SIZE */
+#define SLKQ_MSG_CLASSES (SLKQ_MSG_CLASS_MAX_SHIFT - SLKQ_MSG_CLASS_MIN_SHIFT + 1)
 
-#define SLKQ_SPOOL_COLLAPSE_LIMIT (4096 * 1024)
-#define SLKQ_DISK_BLK_SIZE 4096
+static struct kmem_cache *msg_cache[SLKQ_MSG_CLASSES];
+static char msg_cache_name[SLKQ_MSG_CLASSES][16];
 
-static wait_queue_head_t msg_new_q;   /* (dev_write && NEW) => dev_read unblocks  */
-static wait_queue_head_t msg_spool_q; /* (dev_write && FULL) || (dev_read && EXTEND_COND)
-				        => spool_thread wakes*/
+static inline unsigned int slkq_msg_class (size_t size)
+{
+	if (size <= (1 << SLKQ_MSG_CLASS_MIN_SHIFT))
+		return 0;
 
-static struct mutex in_fifo_lock;
-static struct mutex out_fifo_lock;
+	return fls(size - 1) - SLKQ_MSG_CLASS_MIN_SHIFT;
+}
 
-static struct file *spool_f;
-static atomic_t spool_size = ATOMIC_INIT(0);
-static loff_t spool_pos = 0;
-static struct task_struct *spool_thr;
+static inline void *slkq_msg_alloc (size_t size)
+{
+	return kmem_cache_alloc(msg_cache[slkq_msg_class(size)], GFP_KERNEL);
+}
 
-/* slab allocator is used for in-kernel queue elements (messages) */
-static struct kmem_cache *msg_cache;
+static inline void slkq_msg_free (struct slkq_fifo_msg *m)
+{
+	kmem_cache_free(msg_cache[slkq_msg_class(m->size)], m->buf);
+}
 
 /**
  * /dev/slkq character device is used for communication between kernel-space
  * and user-space applications. read() syscall implies 'pop' operation and
- * write() is used for 'push'
+ * write() is used for 'push'. By default it's one message per syscall,
+ * SLKQ_IOC_SET_MODE ioctl switches open file to batch mode (see common/slkq.h)
  */
 static dev_t dev;
-static struct device *devp;
-static struct cdev chr_dev;
 static struct class *dev_cls = NULL;
 
 /**
- * /proc/slkq_status is used to get queue's statistics
+ * slkq_queues_wake_spool -- lets spool work of all queues re-check state,
+ * pending sync runs now (policy might have changed)
+ */
+static void slkq_queues_wake_spool (void)
+{
+	struct slkq_queue *q;
+	unsigned int i;
+	int id;
+
+	mutex_lock(&slkq_queues_lock);
+	idr_for_each_entry(&slkq_queues, q, id) {
+		for (i = 0; i < q->nparts; i++) {
+			slkq_spool_kick(q->parts[i]);
+			if (!READ_ONCE(q->parts[i]->spool_stopping))
+				mod_delayed_work(slkq_spool_wq,
+						 &q->parts[i]->spool_sync_work, 0);
+		}
+	}
+	mutex_unlock(&slkq_queues_lock);
+}
+
+static void slkq_in_unlock (struct slkq_queue *q);
+
+typedef typeof(((struct slkq_queue *)NULL)->msg_fifo) slkq_msg_fifo_t;
+
+/**
+ * slkq_fifo_swap -- replaces FIFO of 'q' with '*f' moving queued messages
+ * over, old FIFO (now empty) is returned in '*f'
  *
- * Status string consists of 4 numbers: used elements, free elements, total elements,
- * spool size. E.g.
+ * Both q->in_fifo_lock and q->out_fifo_lock are taken, so neither readers nor
+ * writers (nor spool work) touch FIFO while it's being swapped, and
+ * q->spool_load_lock before them, so loader doesn't put batch it took room
+ * for into smaller FIFO. Fails with
+ * -EBUSY if queued messages don't fit into '*f'. Called with
+ * slkq_queues_lock down.
+ */
+static int slkq_fifo_swap (struct slkq_queue *q, slkq_msg_fifo_t *f)
+{
+	slkq_msg_fifo_t old_fifo;
+	struct slkq_fifo_msg m;
+
+	mutex_lock(&q->spool_load_lock);
+	mutex_lock(&q->in_fifo_lock);
+	mutex_lock(&q->out_fifo_lock);
+
+	if (kfifo_len(&q->msg_fifo) > kfifo_size(f)) {
+		mutex_unlock(&q->out_fifo_lock);
+		slkq_in_unlock(q);
+		mutex_unlock(&q->spool_load_lock);
+		return -EBUSY;
+	}
+
+	while (kfifo_get(&q->msg_fifo, &m))
+		kfifo_put(f, m);
+
+	old_fifo = q->msg_fifo;
+	q->msg_fifo = *f;
+	*f = old_fifo;
+
+	mutex_unlock(&q->out_fifo_lock);
+	slkq_in_unlock(q);
+	mutex_unlock(&q->spool_load_lock);
+
+	dev_dbg(q->devp, "%s: capacity is %u now\n", __func__,
+		kfifo_size(&q->msg_fifo));
+
+	/* state of FIFO relative to thresholds might have changed */
+	slkq_spool_kick(q);
+	wake_up_interruptible(&q->parent->msg_space_q);
+
+	return 0;
+}
+
+/**
+ * slkq_fifos_swap -- swaps FIFOs of up to 'n' partitions (in queue id order)
+ * with 'fifos', stops at first failure stored in '*ret'. Returns number of
+ * partitions swapped. Called with slkq_queues_lock down.
+ */
+static unsigned int slkq_fifos_swap (slkq_msg_fifo_t *fifos, unsigned int n,
+				     int *ret)
+{
+	struct slkq_queue *q;
+	unsigned int i, k = 0;
+	int id;
+
+	idr_for_each_entry(&slkq_queues, q, id) {
+		for (i = 0; i < q->nparts && k < n; i++, k++) {
+			*ret = slkq_fifo_swap(q->parts[i], &fifos[k]);
+			if (*ret)
+				return k;
+		}
+	}
+
+	return k;
+}
+
+/**
+ * slkq_param_set_length -- resizes FIFOs of all queues (partitions)
  *
- * $ cat /proc/slkq_status
- * 768 256 1024 259
+ * All new FIFOs are allocated up front, so the only way to fail halfway is
+ * partition holding more messages than new capacity. Partitions resized by
+ * then get their old FIFOs back, i.e. either all of them are resized or
+ * none is.
+ */
+static int slkq_param_set_length (const char *val,
+				  const struct kernel_param *kp)
+{
+	slkq_msg_fifo_t *fifos;
+	struct slkq_queue *q;
+	unsigned int v, k, n = 0;
+	int ret, err = 0, id;
+
+	ret = kstrtouint(val, 0, &v);
+	if (ret)
+		return ret;
+
+	if (v < 2 || v > SLKQ_FIFO_LENGTH_MAX)
+		return -EINVAL;
+
+	mutex_lock(&slkq_queues_lock);
+
+	idr_for_each_entry(&slkq_queues, q, id)
+		n += q->nparts;
+
+	fifos = kvmalloc_array(n, sizeof(*fifos), GFP_KERNEL);
+	if (!fifos) {
+		ret = -ENOMEM;
+		goto err0;
+	}
+
+	for (k = 0; k < n; k++) {
+		ret = kfifo_alloc(&fifos[k], v, GFP_KERNEL);
+		if (ret)
+			goto err1;
+	}
+
+	k = slkq_fifos_swap(fifos, n, &ret);
+	if (ret) {
+		/* -EBUSY means shrinking, so messages of partitions resized
+		 * so far fit into their old FIFOs */
+		slkq_fifos_swap(fifos, k, &err);
+		WARN_ON(err);
+	} else {
+		fifo_length = roundup_pow_of_two(v);
+
+		/* thresholds that don't fit anymore fall back to defaults */
+		if (fifo_extend_limit >= fifo_length)
+			fifo_extend_limit = 0;
+		if (fifo_extend_to >= fifo_length)
+			fifo_extend_to = 0;
+	}
+
+	/* old FIFOs after success, new ones otherwise */
+	k = n;
+err1:
+	while (k--)
+		kfifo_free(&fifos[k]);
+	kvfree(fifos);
+err0:
+	mutex_unlock(&slkq_queues_lock);
+
+	return ret;
+}
+
+static const struct kernel_param_ops slkq_length_ops = {
+	.set = slkq_param_set_length,
+	.get = param_get_uint,
+};
+
+module_param_cb(fifo_length, &slkq_length_ops, &fifo_length, 0644);
+MODULE_PARM_DESC(fifo_length, "in-kernel FIFO capacity, rounded up to power of 2 (default: 1024)");
+
+static int slkq_param_set_threshold (const char *val,
+				     const struct kernel_param *kp)
+{
+	unsigned int v;
+	int ret;
+
+	ret = kstrtouint(val, 0, &v);
+	if (ret)
+		return ret;
+
+	if (v >= fifo_length)
+		return -EINVAL;
+
+	*(unsigned int *)kp->arg = v;
+
+	slkq_queues_wake_spool();
+
+	return 0;
+}
+
+static const struct kernel_param_ops slkq_threshold_ops = {
+	.set = slkq_param_set_threshold,
+	.get = param_get_uint,
+};
+
+module_param_cb(extend_limit, &slkq_threshold_ops, &fifo_extend_limit, 0644);
+MODULE_PARM_DESC(extend_limit, "FIFO length at or below which spool gets loaded (default: 1/2 of capacity)");
+module_param_cb(extend_to, &slkq_threshold_ops, &fifo_extend_to, 0644);
+MODULE_PARM_DESC(extend_to, "FIFO length spool gets loaded to (default: 3/4 of capacity)");
+
+static int slkq_param_set_sync (const char *val,
+				const struct kernel_param *kp)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(spool_sync_names); i++) {
+		if (sysfs_streq(val, spool_sync_names[i])) {
+			spool_sync = i;
+			slkq_queues_wake_spool();
+
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int slkq_param_get_sync (char *buf, const struct kernel_param *kp)
+{
+	return sprintf(buf, "%s\n", spool_sync_names[spool_sync]);
+}
+
+static const struct kernel_param_ops slkq_sync_ops = {
+	.set = slkq_param_set_sync,
+	.get = slkq_param_get_sync,
+};
+
+module_param_cb(spool_sync, &slkq_sync_ops, &spool_sync, 0644);
+MODULE_PARM_DESC(spool_sync, "spool durability policy: none, batch or time (default: batch)");
+module_param(spool_sync_ms, uint, 0644);
+MODULE_PARM_DESC(spool_sync_ms, "spool sync interval for 'time' policy, ms (default: 1000)");
+
+/**
+ * __spool_seg_open -- opens spool segment file 'seq' of queue 'q'
+ */
+static struct file *__spool_seg_open (struct slkq_queue *q, u64 seq, int flags)
+{
+	char name[96];
+
+	snprintf(name, sizeof(name), "%s.%016llx.dat", q->prefix, seq);
+
+	return filp_open(name, O_RDWR | flags, 0600);
+}
+
+/**
+ * __spool_seg_unlink -- removes (consumed) spool segment file
+ */
+static int __spool_seg_unlink (struct file *f)
+{
+	struct dentry *dentry = f->f_path.dentry;
+	struct dentry *parent;
+	struct inode *dir;
+	int ret;
+
+	ret = mnt_want_write(f->f_path.mnt);
+	if (ret)
+		return ret;
+
+	parent = dget_parent(dentry);
+	dir = d_inode(parent);
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	ret = vfs_unlink(dir, dentry, NULL);
+	inode_unlock(dir);
+
+	dput(parent);
+	mnt_drop_write(f->f_path.mnt);
+
+	return ret;
+}
+
+/**
+ * __spool_write -- writes whole buffer to tail segment at 'pos'
+ */
+static int __spool_write (struct slkq_queue *q, const char *buf, size_t len, loff_t pos)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = kernel_write(q->spool_tail_f, buf, len, pos);
+		if (ret <= 0) {
+			dev_err(q->devp, "%s: kernel_write failed (%zd)\n",
+				__func__, ret);
+			return (ret < 0) ? ret : -EIO;
+		}
+
+		buf += ret;
+		len -= ret;
+		pos += ret;
+	}
+
+	return 0;
+}
+
+/**
+ * __spool_checkpoint -- stores head segment and read offset in checkpoint file
  *
- * There is in-kernel queue with total of 1024 elements (768 used, 256 free), and on-disk
- * spool holds 259 elements
-  */
-static struct proc_dir_entry *status_ent;
+ * Must be called with q->spool_ckpt_lock down (or on queue setup/teardown)
+ */
+static int __spool_checkpoint (struct slkq_queue *q, u64 seq, loff_t pos,
+			       unsigned int skip, bool sync)
+{
+	struct slkq_spool_ckpt c = {
+		.magic = SLKQ_SPOOL_CKPT_MAGIC,
+		.version = 1,
+		.head_seq = seq,
+		.head_pos = pos,
+		.head_skip = skip,
+	};
+
+	c.crc = crc32c(~0, &c, offsetof(struct slkq_spool_ckpt, crc));
+
+	if (kernel_write(q->spool_ckpt_f, (char *)&c, sizeof(c), 0) != sizeof(c)) {
+		dev_err(q->devp, "%s: kernel_write failed\n", __func__);
+		return -EIO;
+	}
+
+	if (sync && vfs_fsync(q->spool_ckpt_f, 1))
+		dev_err(q->devp, "%s: vfs_fsync failed\n", __func__);
+
+	q->spool_ckpt_seq = seq;
+
+	return 0;
+}
+
+/**
+ * __spool_head_end -- end of data in head segment, given tail segment
+ * 'tail_seq' of 'tail_size' bytes
+ */
+static loff_t __spool_head_end (struct slkq_queue *q, u64 tail_seq,
+				loff_t tail_size)
+{
+	if (q->spool_head_seq == tail_seq)
+		return tail_size;
+
+	/* preallocation keeps size, so it's the amount of data written */
+	return i_size_read(file_inode(q->spool_head_f));
+}
+
+/**
+ * __spool_rotate -- starts new tail segment
+ *
+ * Called by flush with no locks held (tail segment is written by flush only),
+ * new segment is published under q->in_fifo_lock.
+ */
+static int __spool_rotate (struct slkq_queue *q)
+{
+	struct file *f, *old;
+	bool put;
+
+	f = __spool_seg_open(q, q->spool_tail_seq + 1, O_CREAT | O_TRUNC);
+	if (IS_ERR(f)) {
+		dev_err(q->devp, "%s: failed to open segment %llu\n", __func__,
+			q->spool_tail_seq + 1);
+		return PTR_ERR(f);
+	}
+
+	/* best effort, not every filesystem supports it */
+	vfs_fallocate(f, FALLOC_FL_KEEP_SIZE, 0, spool_seg_size);
+
+	/* complete segment is made durable as per policy before moving on */
+	if (spool_sync != SLKQ_SPOOL_SYNC_NONE)
+		vfs_fsync(q->spool_tail_f, 1);
+
+	mutex_lock(&q->in_fifo_lock);
+
+	old = q->spool_tail_f;
+	put = (old != q->spool_head_f);
+
+	q->spool_tail_f = f;
+	q->spool_tail_seq++;
+	q->spool_tail_size = 0;
+
+	slkq_in_unlock(q);
+
+	/* loader moves on to new segment without old one once it's head */
+	if (put)
+		filp_close(old, NULL);
+
+	dev_dbg(q->devp, "%s: tail segment %llu\n", __func__, q->spool_tail_seq);
+
+	return 0;
+}
+
+/**
+ * __spool_advance -- drops consumed head segment and moves on to next one
+ *
+ * Next segment is opened with no locks held (unless it's tail one, which
+ * flush might rotate meanwhile) and published under q->in_fifo_lock, then
+ * checkpoint is moved to it and consumed segment is unlinked and closed
+ * with the lock released.
+ *
+ * Must be called with q->spool_load_lock down, records loaded committed
+ */
+static int __spool_advance (struct slkq_queue *q)
+{
+	struct file *f, *old = q->spool_head_f;
+	u64 seq = q->spool_head_seq + 1;
+
+	mutex_lock(&q->in_fifo_lock);
+
+	/* segment that isn't tail one now never becomes it */
+	if (seq != q->spool_tail_seq) {
+		slkq_in_unlock(q);
+
+		f = __spool_seg_open(q, seq, 0);
+		if (IS_ERR(f)) {
+			dev_err(q->devp, "%s: failed to open segment %llu\n",
+				__func__, seq);
+			return PTR_ERR(f);
+		}
+
+		mutex_lock(&q->in_fifo_lock);
+	} else {
+		f = q->spool_tail_f;
+	}
+
+	q->spool_head_f = f;
+	q->spool_head_seq = seq;
+	q->spool_pos = q->spool_done_pos = 0;
+
+	slkq_in_unlock(q);
+
+	/* read buffers hold data of previous segment */
+	q->spool_rbuf[0].len = q->spool_rbuf[1].len = 0;
+
+	/* checkpoint must not point to segment being removed */
+	mutex_lock(&q->spool_ckpt_lock);
+	__spool_checkpoint(q, seq, 0, 0, spool_sync != SLKQ_SPOOL_SYNC_NONE);
+	mutex_unlock(&q->spool_ckpt_lock);
+
+	if (__spool_seg_unlink(old))
+		dev_err(q->devp, "%s: failed to unlink segment %llu\n", __func__,
+			seq - 1);
+	else
+		SLKQ_STAT_INC(q, seg_reclaim);
+
+	filp_close(old, NULL);
+
+	dev_dbg(q->devp, "%s: head segment %llu\n", __func__, seq);
+
+	return 0;
+}
+
+/**
+ * __spool_batch -- length of whole records in flight (at spool_fbuf head) that fit
+ * into tail segment, as they are or (worst case) compressed into frame if
+ * 'z' is set, their number is stored to 'n'
+ */
+static size_t __spool_batch (struct slkq_queue *q, bool z, unsigned int *n)
+{
+	size_t len, rec, out;
+	u_int16_t siz;
+
+	for (len = 0, *n = 0; q->spool_fbuf_head + len < q->spool_fbuf_used;
+	     len += rec, (*n)++) {
+		memcpy(&siz, q->spool_fbuf + q->spool_fbuf_head + len, sizeof(siz));
+		rec = SLKQ_SPOOL_REC_HDR_SIZE + siz;
+
+		out = (z) ? (SLKQ_SPOOL_FRAME_HDR_SIZE + LZ4_COMPRESSBOUND(len + rec))
+			  : (len + rec);
+
+		if (q->spool_tail_size + out > spool_seg_size)
+			break;
+	}
+
+	return len;
+}
+
+/**
+ * __spool_compress -- compresses 'len' bytes ('n' records) at spool_fbuf head
+ * into frame in q->spool_cbuf
+ *
+ * Returns frame size, 0 if it's not smaller than records.
+ */
+static size_t __spool_compress (struct slkq_queue *q, size_t len, unsigned int n)
+{
+	struct slkq_spool_frame fr = {
+		.magic = SLKQ_SPOOL_FRAME_MAGIC,
+		.rlen = len,
+		.n = n,
+	};
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = LZ4_compress_default(q->spool_fbuf + q->spool_fbuf_head,
+				   q->spool_cbuf + SLKQ_SPOOL_FRAME_HDR_SIZE, len,
+				   LZ4_COMPRESSBOUND(len), q->spool_lz4_wrk);
+
+	SLKQ_STAT_ADD(q, compress_ns, ktime_get_ns() - start);
+
+	if (ret <= 0 || SLKQ_SPOOL_FRAME_HDR_SIZE + ret >= len)
+		return 0;
+
+	fr.clen = ret;
+	fr.crc = crc32c(~0, q->spool_cbuf + SLKQ_SPOOL_FRAME_HDR_SIZE, ret);
+	memcpy(q->spool_cbuf, &fr, sizeof(fr));
+
+	SLKQ_STAT_ADD(q, compress_in, len);
+	SLKQ_STAT_ADD(q, compress_out, SLKQ_SPOOL_FRAME_HDR_SIZE + ret);
+
+	return SLKQ_SPOOL_FRAME_HDR_SIZE + ret;
+}
+
+/**
+ * __spool_wbuf_detach -- hands records of staging buffer over to flush
+ * (spool_fbuf), writers go on with empty buffer
+ *
+ * Must be called with q->in_fifo_lock down and nothing in flight
+ */
+static void __spool_wbuf_detach (struct slkq_queue *q)
+{
+	if (!SLKQ_SPOOL_FLUSH_COND(q))
+		return;
+
+	swap(q->spool_wbuf, q->spool_fbuf);
+	q->spool_fbuf_head = q->spool_wbuf_head;
+	q->spool_fbuf_used = q->spool_wbuf_used;
+	q->spool_fbuf_n = q->spool_wbuf_n;
+
+	q->spool_wbuf_head = q->spool_wbuf_used = 0;
+	q->spool_wbuf_n = 0;
+}
+
+/**
+ * __spool_flush -- writes records in flight out to tail segment (as frames
+ * if compression is on), starting new segments as they fill up
+ *
+ * Staging buffer is taken over first if nothing is in flight, unless 'all'
+ * is clear and loader is about to take records from it (so they don't go
+ * to disk and back). Data is written and synced with no locks held,
+ * q->in_fifo_lock is taken to publish each batch to loader. Records stay
+ * in flight on error, next call retries them.
+ *
+ * Called by flush work (or on unload) with no locks held
+ */
+static int __spool_flush (struct slkq_queue *q, bool all)
+{
+	size_t len, out, written = 0;
+	unsigned int n, left;
+	u64 start = ktime_get_ns();
+	bool z;
+	int ret = 0;
+
+	mutex_lock(&q->in_fifo_lock);
+
+	if (!q->spool_fbuf_n &&
+	    (all || q->spool_disk_n || !SLKQ_FIFO_EXTEND_COND(q)))
+		__spool_wbuf_detach(q);
+	left = q->spool_fbuf_n;
+
+	slkq_in_unlock(q);
+
+	while (left) {
+		z = (q->spool_cbuf != NULL);
+		len = __spool_batch(q, z, &n);
+
+		/* segment can't hold frame of even single record */
+		if (!len && z && !q->spool_tail_size) {
+			z = false;
+			len = __spool_batch(q, z, &n);
+		}
+
+		if (!len) {
+			ret = __spool_rotate(q);
+			if (ret)
+				break;
+			continue;
+		}
+
+		out = (z) ? (__spool_compress(q, len, n)) : (0);
+
+		if (out) {
+			ret = __spool_write(q, q->spool_cbuf, out,
+					    q->spool_tail_size);
+		} else {
+			out = len;
+			ret = __spool_write(q, q->spool_fbuf + q->spool_fbuf_head,
+					    len, q->spool_tail_size);
+		}
+
+		if (ret) {
+			dev_err(q->devp, "%s: write out failed (%d)\n", __func__,
+				ret);
+			break;
+		}
+
+		written += out;
+
+		mutex_lock(&q->in_fifo_lock);
+
+		q->spool_tail_size += out;
+		q->spool_disk_n += n;
+		q->spool_fbuf_n -= n;
+		q->spool_fbuf_head += len;
+		q->spool_dirty = true;
+		left = q->spool_fbuf_n;
+
+		slkq_spool_sync_kick(q);
+		slkq_in_unlock(q);
+	}
+
+	if (written) {
+		SLKQ_STAT_INC(q, flush);
+		SLKQ_STAT_ADD(q, flush_bytes, written);
+		SLKQ_STAT_INC(q, flush_lat[slkq_hist_bucket(ktime_get_ns() -
+							     start)]);
+	}
+
+	dev_dbg(q->devp, "%s: %u records on disk\n", __func__, q->spool_disk_n);
+
+	return ret;
+}
+
+/**
+ * __spool_append -- appends message to spool (tail of queue)
+ *
+ * Message is copied into staging buffer and freed. If there is no room,
+ * buffer is handed over to flush work, or -EAGAIN is returned (message stays
+ * with caller) while previous one is still being written out.
+ *
+ * Must be called with q->in_fifo_lock down
+ */
+static int __spool_append (struct slkq_queue *q, struct slkq_fifo_msg *m)
+{
+	size_t rec = SLKQ_SPOOL_REC_HDR_SIZE + m->size;
+	u32 crc;
+
+	if (q->spool_wbuf_used + rec > SLKQ_SPOOL_WBUF_SIZE) {
+		if (q->spool_fbuf_n)
+			return -EAGAIN;
+
+		__spool_wbuf_detach(q);
+		slkq_spool_queue(q, &q->spool_flush_work, 0);
+	}
+
+	crc = crc32c(~0, m->buf, m->size);
+
+	/**
+	 * Spool file uses variable record format where the record's first two
+	 * bytes indicate the length of the record, CRC32C follows.
+	 */
+	memcpy(q->spool_wbuf + q->spool_wbuf_used, &m->size, sizeof(m->size));
+	memcpy(q->spool_wbuf + q->spool_wbuf_used + sizeof(m->size), &crc,
+	       sizeof(crc));
+	memcpy(q->spool_wbuf + q->spool_wbuf_used + SLKQ_SPOOL_REC_HDR_SIZE, m->buf,
+	       m->size);
+	q->spool_wbuf_used += rec;
+	q->spool_wbuf_n++;
+	atomic_inc(&q->spool_size);
+
+	slkq_msg_free(m);
+
+	return 0;
+}
+
+/**
+ * __spool_wbuf_take -- takes oldest record out of staging buffer
+ *
+ * Must be called with q->in_fifo_lock down
+ */
+static int __spool_wbuf_take (struct slkq_queue *q, struct slkq_fifo_msg *m)
+{
+	u_int16_t siz;
+
+	if (!SLKQ_SPOOL_FLUSH_COND(q))
+		return -EIO;
+
+	memcpy(&siz, q->spool_wbuf + q->spool_wbuf_head, sizeof(siz));
+
+	m->size = siz;
+	m->ts = 0;
+	m->buf = slkq_msg_alloc(siz);
+	if (!m->buf) {
+		dev_err(q->devp, "%s: slkq_msg_alloc failed\n", __func__);
+		return -ENOMEM;
+	}
+
+	memcpy(m->buf, q->spool_wbuf + q->spool_wbuf_head + SLKQ_SPOOL_REC_HDR_SIZE,
+	       siz);
+
+	q->spool_wbuf_head += SLKQ_SPOOL_REC_HDR_SIZE + siz;
+	q->spool_wbuf_n--;
+
+	if (q->spool_wbuf_head == q->spool_wbuf_used)
+		q->spool_wbuf_head = q->spool_wbuf_used = 0;
+
+	return 0;
+}
+
+/**
+ * __slkq_drop_oldest -- drops message at FIFO head to make room for new one
+ *
+ * Must be called with q->in_fifo_lock down
+ */
+static void __slkq_drop_oldest (struct slkq_queue *q)
+{
+	struct slkq_fifo_msg m;
+
+	mutex_lock(&q->out_fifo_lock);
+
+	if (kfifo_get(&q->msg_fifo, &m)) {
+		slkq_msg_free(&m);
+		SLKQ_STAT_INC(q, drop_oldest);
+	}
+
+	mutex_unlock(&q->out_fifo_lock);
+}
+
+/**
+ * __slkq_push -- pushes message to queue: to FIFO if spool is empty and there
+ * is room, appends to spool otherwise (so order is kept)
+ *
+ * If FIFO is full (and spool is empty), queue's full policy applies: with
+ * SLKQ_FULL_BLOCK -EAGAIN is returned and message stays with caller, which
+ * waits for room (see slkq_wait_space), drop policies drop either oldest
+ * message or this one. Spool returns -EAGAIN too once staging buffer is
+ * full while flush work is still busy with previous one.
+ *
+ * Message is owned by queue on success.
+ *
+ * Must be called with q->in_fifo_lock down
+ */
+static int __slkq_push (struct slkq_queue *q, struct slkq_fifo_msg *m)
+{
+	u_int16_t siz = m->size;
+	int ret;
+
+	if (atomic_read(&q->spool_size) == 0) {
+		switch (kfifo_is_full(&q->msg_fifo) ? slkq_full_policy(q) :
+			SLKQ_FULL_SPOOL) {
+		case SLKQ_FULL_BLOCK:
+			return -EAGAIN;
+		case SLKQ_FULL_DROP_NEWEST:
+			slkq_msg_free(m);
+			SLKQ_STAT_INC(q, drop_newest);
+			return 0;
+		case SLKQ_FULL_DROP_OLDEST:
+			__slkq_drop_oldest(q);
+			break;
+		}
+
+		if (kfifo_put(&q->msg_fifo, *m)) {
+			SLKQ_STAT_INC(q, enq);
+			SLKQ_STAT_ADD(q, enq_bytes, siz);
+			return 0;
+		}
+	}
+
+	ret = __spool_append(q, m);
+	if (ret)
+		return ret;
+
+	SLKQ_STAT_INC(q, enq);
+	SLKQ_STAT_ADD(q, enq_bytes, siz);
+	SLKQ_STAT_INC(q, spill);
+	SLKQ_STAT_ADD(q, spill_bytes, siz);
+
+	return 0;
+}
+
+/* slkq_stat_deq -- accounts message popped from FIFO */
+static inline void slkq_stat_deq (struct slkq_queue *q, struct slkq_fifo_msg *m)
+{
+	SLKQ_STAT_INC(q, deq);
+	SLKQ_STAT_ADD(q, deq_bytes, m->size);
+
+	if (m->ts)
+		SLKQ_STAT_INC(q, residence[slkq_hist_bucket(ktime_get_ns() -
+							     m->ts)]);
+}
+
+/**
+ * __stage_drain -- moves staged messages of all CPUs into queue
+ *
+ * Returns number of messages moved or error (those not moved stay staged,
+ * -EAGAIN if FIFO is full and queue's policy is SLKQ_FULL_BLOCK, or if
+ * spool can't take more till flush completes).
+ *
+ * Must be called with q->in_fifo_lock down
+ */
+static int __stage_drain (struct slkq_queue *q)
+{
+	struct slkq_stage *st;
+	struct slkq_fifo_msg m;
+	int cpu, n = 0, ret = 0;
+
+	if (!q->stage)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(q->stage, cpu);
+
+		while (kfifo_peek(&st->fifo, &m)) {
+			ret = __slkq_push(q, &m);
+			if (ret)
+				goto out;
+
+			/* slot is read before producer may reuse it */
+			smp_mb();
+			kfifo_skip(&st->fifo);
+			n++;
+		}
+	}
+out:
+	slkq_spool_kick(q);
+
+	if (n)
+		wake_up_interruptible(&q->parent->msg_new_q);
+
+	return (ret) ? (ret) : (n);
+}
+
+/* __stage_pending -- whether any of CPUs has staged messages */
+static bool __stage_pending (struct slkq_queue *q)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!kfifo_is_empty(&per_cpu_ptr(q->stage, cpu)->fifo))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * slkq_in_unlock -- drains staged messages and releases q->in_fifo_lock
+ *
+ * Writer that staged message while lock was held relies on holder to drain
+ * it, so rings are checked again after unlock (pairs with smp_mb() in
+ * slkq_stage_kick).
+ */
+static void slkq_in_unlock (struct slkq_queue *q)
+{
+	int ret;
+
+	for (;;) {
+		ret = __stage_drain(q);
+		mutex_unlock(&q->in_fifo_lock);
+
+		if (!q->stage || ret < 0)
+			return;
+
+		smp_mb();
+
+		if (!__stage_pending(q) || !mutex_trylock(&q->in_fifo_lock))
+			return;
+	}
+}
+
+/**
+ * slkq_stage_unblock -- drains staged messages once reader made room, with
+ * SLKQ_FULL_BLOCK policy they might be left staged by writer that found
+ * FIFO full
+ */
+static void slkq_stage_unblock (struct slkq_queue *q)
+{
+	if (!q->stage || slkq_full_policy(q) != SLKQ_FULL_BLOCK)
+		return;
+
+	/* room is visible before staging rings are checked */
+	smp_mb();
+
+	if (__stage_pending(q) && mutex_trylock(&q->in_fifo_lock))
+		slkq_in_unlock(q);
+}
+
+/**
+ * __spool_read -- reads from spool into read buffer 'rb' starting at 'pos',
+ * at least 'min' bytes (as much as buffer holds at most)
+ */
+static int __spool_read (struct slkq_queue *q, struct slkq_spool_rbuf *rb, loff_t pos, size_t min)
+{
+	int ret;
+
+	rb->off = pos;
+	rb->len = 0;
+
+	while (rb->len < SLKQ_SPOOL_RBUF_SIZE) {
+		ret = kernel_read(q->spool_head_f, pos + rb->len, rb->buf + rb->len,
+				  SLKQ_SPOOL_RBUF_SIZE - rb->len);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+
+		rb->len += ret;
+	}
+
+	return (rb->len < min) ? -EIO : 0;
+}
+
+/**
+ * __spool_rbuf_get -- returns pointer to 'len' bytes of spool at 'pos'
+ *
+ * Data is taken from current read buffer, or from prefetched one (which
+ * becomes current then). Spool is read synchronously only if neither of
+ * them has it.
+ */
+static unsigned char *__spool_rbuf_get (struct slkq_queue *q, loff_t pos, size_t len)
+{
+	struct slkq_spool_rbuf *rb = &q->spool_rbuf[q->spool_rbuf_cur];
+	struct slkq_spool_rbuf *next = &q->spool_rbuf[q->spool_rbuf_cur ^ 1];
+
+	if (pos >= rb->off && pos + len <= rb->off + rb->len)
+		return rb->buf + (pos - rb->off);
+
+	if (next->len && pos >= next->off &&
+	    pos + len <= next->off + next->len) {
+		rb->len = 0;
+		q->spool_rbuf_cur ^= 1;
+		return next->buf + (pos - next->off);
+	}
+
+	if (__spool_read(q, rb, pos, len)) {
+		dev_err(q->devp, "%s: kernel_read at %lld failed\n", __func__, pos);
+		rb->len = 0;
+		return NULL;
+	}
+
+	return rb->buf;
+}
+
+/**
+ * __spool_prefetch -- reads chunk following current read buffer into spare
+ * one
+ *
+ * Called by load work with q->spool_load_lock down after FIFO got loaded, so
+ * next load is served from memory while readers drain the FIFO.
+ */
+static void __spool_prefetch (struct slkq_queue *q)
+{
+	struct slkq_spool_rbuf *rb = &q->spool_rbuf[q->spool_rbuf_cur];
+	struct slkq_spool_rbuf *next = &q->spool_rbuf[q->spool_rbuf_cur ^ 1];
+	unsigned int disk_n;
+	loff_t end;
+
+	if (next->len || !rb->len)
+		return;
+
+	mutex_lock(&q->in_fifo_lock);
+	disk_n = q->spool_disk_n;
+	end = __spool_head_end(q, q->spool_tail_seq, q->spool_tail_size);
+	slkq_in_unlock(q);
+
+	/* spool has nothing past current buffer yet */
+	if (!disk_n || rb->off + rb->len >= end)
+		return;
+
+	if (__spool_read(q, next, rb->off + rb->len, 0))
+		next->len = 0;
+}
+
+/**
+ * __spool_frame_load -- decompresses frame at spool_pos into spool_zbuf and
+ * skips its records consumed already
+ *
+ * Must be called with q->spool_load_lock down
+ */
+static int __spool_frame_load (struct slkq_queue *q)
+{
+	struct slkq_spool_frame fr;
+	unsigned char *p;
+	u_int16_t siz;
+	unsigned int i;
+	u64 start;
+	int ret;
+
+	p = __spool_rbuf_get(q, q->spool_pos, SLKQ_SPOOL_FRAME_HDR_SIZE);
+	if (!p)
+		return -EIO;
+
+	memcpy(&fr, p, sizeof(fr));
+
+	if (SLKQ_SPOOL_FRAME_HDR_SIZE + fr.clen > SLKQ_SPOOL_RBUF_SIZE ||
+	    fr.rlen > SLKQ_SPOOL_WBUF_SIZE || q->spool_zskip >= fr.n)
+		goto bad;
+
+	p = __spool_rbuf_get(q, q->spool_pos + SLKQ_SPOOL_FRAME_HDR_SIZE, fr.clen);
+	if (!p)
+		return -EIO;
+
+	if (crc32c(~0, p, fr.clen) != fr.crc)
+		goto bad;
+
+	start = ktime_get_ns();
+	ret = LZ4_decompress_safe(p, q->spool_zbuf, fr.clen, SLKQ_SPOOL_WBUF_SIZE);
+	SLKQ_STAT_ADD(q, decompress_ns, ktime_get_ns() - start);
+
+	if (ret != fr.rlen)
+		goto bad;
+
+	for (q->spool_zpos = 0, i = 0; i < q->spool_zskip; i++) {
+		if (q->spool_zpos + SLKQ_SPOOL_REC_HDR_SIZE > fr.rlen)
+			goto bad;
+
+		memcpy(&siz, q->spool_zbuf + q->spool_zpos, sizeof(siz));
+		q->spool_zpos += SLKQ_SPOOL_REC_HDR_SIZE + siz;
+	}
+
+	q->spool_zlen = fr.rlen;
+	q->spool_zframe = SLKQ_SPOOL_FRAME_HDR_SIZE + fr.clen;
+
+	return 0;
+bad:
+	dev_err(q->devp, "%s: bad frame at %llu:%lld\n", __func__,
+		q->spool_head_seq, q->spool_pos);
+	return -EIO;
+}
+
+/**
+ * __spool_zrec -- returns message of next record of frame being loaded,
+ * stores its length and CRC to 'siz' and 'crc'
+ */
+static unsigned char *__spool_zrec (struct slkq_queue *q, u_int16_t *siz, u32 *crc)
+{
+	unsigned char *p = q->spool_zbuf + q->spool_zpos;
+
+	if (q->spool_zpos + SLKQ_SPOOL_REC_HDR_SIZE <= q->spool_zlen) {
+		memcpy(siz, p, sizeof(*siz));
+		memcpy(crc, p + sizeof(*siz), sizeof(*crc));
+
+		if (q->spool_zpos + SLKQ_SPOOL_REC_HDR_SIZE + *siz <= q->spool_zlen)
+			return p + SLKQ_SPOOL_REC_HDR_SIZE;
+	}
+
+	dev_err(q->devp, "%s: bad frame at %llu:%lld\n", __func__,
+		q->spool_head_seq, q->spool_pos);
+	return NULL;
+}
+
+/**
+ * __spool_load_batch -- parses up to 'n' records of head segment (its data
+ * ending at 'end') into q->spool_lmsg, returns number of records parsed
+ *
+ * File records are parsed out of read buffers (see __spool_rbuf_get), so
+ * loading takes a kernel_read() per SLKQ_SPOOL_RBUF_SIZE bytes of spool at
+ * most. Frame is decompressed at once and its records are taken from
+ * spool_zbuf. Error is returned only if no record got parsed, records
+ * parsed before it are loaded and next call hits it again.
+ *
+ * Called with q->spool_load_lock down and q->in_fifo_lock released, records
+ * parsed aren't in FIFO till caller puts them there.
+ */
+static int __spool_load_batch (struct slkq_queue *q, unsigned int n, loff_t end)
+{
+	struct slkq_fifo_msg *m;
+	unsigned int got = 0;
+	unsigned char *p;
+	u_int16_t siz;
+	u32 crc;
+	int ret = -EIO;
+
+	while (got < n && (q->spool_zlen || q->spool_pos < end)) {
+		if (q->spool_zlen) {
+			p = __spool_zrec(q, &siz, &crc);
+			if (!p)
+				break;
+		} else {
+			p = __spool_rbuf_get(q, q->spool_pos, SLKQ_SPOOL_REC_HDR_SIZE);
+			if (!p)
+				break;
+
+			memcpy(&siz, p, sizeof(siz));
+			memcpy(&crc, p + sizeof(siz), sizeof(crc));
+
+			if (!siz && crc == SLKQ_SPOOL_FRAME_MAGIC) {
+				if (__spool_frame_load(q))
+					break;
+				continue;
+			}
+
+			p = __spool_rbuf_get(q, q->spool_pos + SLKQ_SPOOL_REC_HDR_SIZE,
+					     siz);
+			if (!p)
+				break;
+		}
+
+		if (crc32c(~0, p, siz) != crc) {
+			dev_err(q->devp, "%s: bad CRC at %llu:%lld\n", __func__,
+				q->spool_head_seq, q->spool_pos);
+			break;
+		}
+
+		m = &q->spool_lmsg[got];
+		m->size = siz;
+		m->ts = 0;
+		m->buf = slkq_msg_alloc(siz);
+
+		if (!m->buf) {
+			dev_err(q->devp, "%s: slkq_msg_alloc failed\n", __func__);
+			ret = -ENOMEM;
+			break;
+		}
+
+		memcpy(m->buf, p, siz);
+		got++;
+
+		if (!q->spool_zlen) {
+			q->spool_pos += SLKQ_SPOOL_REC_HDR_SIZE + siz;
+		} else {
+			q->spool_zpos += SLKQ_SPOOL_REC_HDR_SIZE + siz;
+			q->spool_zskip++;
+
+			/* frame is consumed */
+			if (q->spool_zpos >= q->spool_zlen) {
+				q->spool_pos += q->spool_zframe;
+				q->spool_zlen = 0;
+				q->spool_zskip = 0;
+			}
+		}
+	}
+
+	return (got) ? (got) : (ret);
+}
+
+/**
+ * __load_from_spool -- loads messages to queue from spool
+ *
+ * Spool file records come first, then ones from staging buffer (these are
+ * taken under q->in_fifo_lock, without any I/O). Like __spool_flush, loader
+ * takes FIFO room and spool state under q->in_fifo_lock, drops it to read
+ * batch of records (see __spool_load_batch) or to move on to next segment,
+ * and takes it again to put records into FIFO and commit spool position
+ * checkpoint is taken from. Records spooled meanwhile are left to next
+ * round, FIFO room only grows as writers don't put into FIFO while spool
+ * isn't empty.
+ *
+ * Called by load work with q->spool_load_lock down (FIFO isn't swapped under
+ * batch being loaded)
+ */
+static int __load_from_spool (struct slkq_queue *q)
+{
+	struct slkq_fifo_msg m;
+	unsigned int room, n, i;
+	u64 tail_seq;
+	loff_t end;
+	int ret;
+
+	for (;;) {
+		mutex_lock(&q->in_fifo_lock);
+
+		dev_dbg(q->devp, "extend_to = %d, len = %d, q->spool_size = %d\n",
+			SLKQ_FIFO_EXTEND_TO(q), kfifo_len(&q->msg_fifo),
+			atomic_read(&q->spool_size));
+
+		room = (kfifo_len(&q->msg_fifo) < SLKQ_FIFO_EXTEND_TO(q)) ?
+			min_t(unsigned int,
+			      SLKQ_FIFO_EXTEND_TO(q) - kfifo_len(&q->msg_fifo),
+			      kfifo_avail(&q->msg_fifo)) : 0;
+
+		/* records in flight come first, flush requeues load */
+		if (!room || atomic_read(&q->spool_size) <= 0 ||
+		    (!q->spool_disk_n && q->spool_fbuf_n)) {
+			slkq_in_unlock(q);
+			return 0;
+		}
+
+		if (!q->spool_disk_n) {
+			for (ret = 0; room-- && atomic_read(&q->spool_size) > 0;) {
+				ret = __spool_wbuf_take(q, &m);
+				if (ret)
+					break;
+
+				kfifo_put(&q->msg_fifo, m);
+				atomic_dec(&q->spool_size);
+				SLKQ_STAT_INC(q, load);
+				SLKQ_STAT_ADD(q, load_bytes, m.size);
+			}
+
+			slkq_in_unlock(q);
+			return (ret) ? (-EIO) : (0);
+		}
+
+		n = min_t(unsigned int, min(room, q->spool_disk_n),
+			  SLKQ_SPOOL_LOAD_BATCH);
+		tail_seq = q->spool_tail_seq;
+		end = __spool_head_end(q, tail_seq, q->spool_tail_size);
+
+		slkq_in_unlock(q);
+
+		if (q->spool_head_seq != tail_seq && q->spool_pos >= end) {
+			ret = __spool_advance(q);
+			if (ret)
+				return -EIO;
+			continue;
+		}
+
+		ret = __spool_load_batch(q, n, end);
+		if (ret < 0)
+			return ret;
+		n = ret;
+
+		mutex_lock(&q->in_fifo_lock);
+
+		/* room taken above is still there */
+		for (i = 0; i < n; i++) {
+			kfifo_put(&q->msg_fifo, q->spool_lmsg[i]);
+			SLKQ_STAT_ADD(q, load_bytes, q->spool_lmsg[i].size);
+		}
+
+		q->spool_disk_n -= n;
+		atomic_sub(n, &q->spool_size);
+		q->spool_done_pos = q->spool_pos;
+		q->spool_done_skip = q->spool_zskip;
+		q->spool_ckpt_dirty = true;
+		SLKQ_STAT_ADD(q, load, n);
+
+		slkq_spool_sync_kick(q);
+		slkq_in_unlock(q);
+
+		/* readers might be waiting on empty FIFO */
+		wake_up_interruptible(&q->parent->msg_new_q);
+	}
+}
+
+static unsigned int ring_idle_ms = 10;
+module_param(ring_idle_ms, uint, 0644);
+MODULE_PARM_DESC(ring_idle_ms, "time kernel keeps polling idle push ring with SLKQ_RING_POLL_PUSH, ms (default: 10)");
+
+/**
+ * Per open file state: read/write mode and optional shared memory rings
+ * (see SLKQ_IOC_RING_SETUP in common/slkq.h). Kernel keeps its own copies
+ * of indices it owns (push_head, pop_tail), ones found in shared page are
+ * only published to user space.
+ *
+ * With SLKQ_RING_POLL_PUSH push ring is drained by push_work, which keeps
+ * requeueing itself while producer is active. With SLKQ_RING_POLL_POP
+ * pop_wait on queue's msg_new_q has pop_work fill pop ring whenever
+ * messages arrive.
+ */
+struct slkq_ring {
+	void *mem;
+	size_t size;
+	struct slkq_ring_ctl *ctl;
+	struct slkq_file *sf;
+	unsigned int slots;
+	unsigned int slot_size;
+	unsigned int push_off;
+	unsigned int pop_off;
+	u32 flags;
+	struct mutex push_lock; /* push_head */
+	u32 push_head;
+	unsigned long push_busy; /* jiffies push ring was last non-empty */
+	struct delayed_work push_work;
+	struct mutex pop_lock;  /* pop_tail */
+	u32 pop_tail;
+	struct work_struct pop_work;
+	wait_queue_entry_t pop_wait;
+	wait_queue_head_t pop_wq; /* poll() on pop ring */
+};
+
+struct slkq_file {
+	struct slkq_queue *q;
+	int mode;
+	int stage_cpu;     /* CPU last message was staged on, -1 if none */
+	u32 key;           /* partition routing, if 'keyed' */
+	bool keyed;
+	int member_idx;    /* index in consumer group, -1 if not member */
+	struct list_head member;
+	unsigned int next_part;
+	struct mutex lock; /* ring setup */
+	struct slkq_ring *ring;
+};
+
+/* slkq_file_mode -- read/write mode of open file (SLKQ_MODE_*) */
+static inline int slkq_file_mode (struct file *file)
+{
+	return ((struct slkq_file *)file->private_data)->mode;
+}
+
+/* slkq_file_queue -- queue that open file belongs to */
+static inline struct slkq_queue *slkq_file_queue (struct file *file)
+{
+	return ((struct slkq_file *)file->private_data)->q;
+}
+
+static inline unsigned int slkq_key_part (struct slkq_queue *q, u32 key)
+{
+	return hash_32(key, 32) % q->nparts;
+}
+
+/**
+ * slkq_route -- partition write() goes to: by file's key if it has one,
+ * round robin otherwise
+ */
+static struct slkq_queue *slkq_route (struct slkq_file *sf)
+{
+	struct slkq_queue *q = sf->q;
+
+	if (q->nparts == 1)
+		return q;
+
+	if (sf->keyed)
+		return q->parts[slkq_key_part(q, sf->key)];
+
+	return q->parts[(unsigned int)atomic_inc_return(&q->rr) % q->nparts];
+}
+
+/**
+ * slkq_part_assigned -- whether file reads partition 'i': consumer group
+ * member k of n reads partitions with i % n == k, others read all of them
+ */
+static inline bool slkq_part_assigned (struct slkq_file *sf, unsigned int i)
+{
+	int idx = READ_ONCE(sf->member_idx);
+
+	if (idx < 0)
+		return true;
+
+	return i % READ_ONCE(sf->q->nmembers) == idx;
+}
+
+static bool slkq_parts_readable (struct slkq_file *sf)
+{
+	struct slkq_queue *q = sf->q;
+	unsigned int i;
+
+	for (i = 0; i < q->nparts; i++) {
+		if (slkq_part_assigned(sf, i) &&
+		    !kfifo_is_empty(&q->parts[i]->msg_fifo))
+			return true;
+	}
+
+	return false;
+}
+
+static inline unsigned char *slkq_ring_slot (struct slkq_ring *ring,
+					     unsigned int off, u32 idx)
+{
+	return ring->mem + off + (idx & (ring->slots - 1)) * ring->slot_size;
+}
+
+/**
+ * __out_lock_nonempty -- takes q->out_fifo_lock once FIFO has something to pop
+ *
+ * Returns 0 with q->out_fifo_lock down, error otherwise (-EAGAIN if
+ * 'nonblock')
+ */
+static int __out_lock_nonempty (struct slkq_queue *q, bool nonblock)
+{
+	u64 start;
+	int ret;
+
+	if (!mutex_trylock(&q->out_fifo_lock)) {
+		SLKQ_STAT_INC(q, out_contended);
+
+		ret = mutex_lock_interruptible(&q->out_fifo_lock);
+		if (ret)
+			return ret;
+	}
+
+	while (kfifo_is_empty(&q->msg_fifo)) {
+		mutex_unlock(&q->out_fifo_lock);
+
+		if (nonblock) {
+			return -EAGAIN;
+		}
+
+		start = ktime_get_ns();
+		ret = wait_event_interruptible(q->msg_new_q,
+					       !kfifo_is_empty(&q->msg_fifo));
+		SLKQ_STAT_ADD(q, read_blocked_ns, ktime_get_ns() - start);
+
+		if (ret) {
+			return ret;
+		}
+
+		ret = mutex_lock_interruptible(&q->out_fifo_lock);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * slkq_out_lock -- picks partition to pop from and takes its out_fifo_lock
+ *
+ * Partitions assigned to file are tried round robin starting after one
+ * popped from last time. Returns partition with out_fifo_lock down and
+ * something to pop, ERR_PTR otherwise (-EAGAIN if 'nonblock')
+ */
+static struct slkq_queue *slkq_out_lock (struct slkq_file *sf, bool nonblock)
+{
+	struct slkq_queue *q = sf->q, *p;
+	unsigned int i, n;
+	u64 start;
+	int ret;
+
+	if (q->nparts == 1) {
+		ret = __out_lock_nonempty(q, nonblock);
+		return (ret) ? ERR_PTR(ret) : q;
+	}
+
+	for (;;) {
+		for (n = 0; n < q->nparts; n++) {
+			i = (sf->next_part + n) % q->nparts;
+			p = q->parts[i];
+
+			if (!slkq_part_assigned(sf, i) ||
+			    kfifo_is_empty(&p->msg_fifo))
+				continue;
+
+			if (!mutex_trylock(&p->out_fifo_lock)) {
+				SLKQ_STAT_INC(p, out_contended);
+
+				ret = mutex_lock_interruptible(&p->out_fifo_lock);
+				if (ret)
+					return ERR_PTR(ret);
+			}
+
+			if (!kfifo_is_empty(&p->msg_fifo)) {
+				sf->next_part = i + 1;
+				return p;
+			}
+
+			mutex_unlock(&p->out_fifo_lock);
+		}
+
+		if (nonblock)
+			return ERR_PTR(-EAGAIN);
+
+		start = ktime_get_ns();
+		ret = wait_event_interruptible(q->msg_new_q,
+					       slkq_parts_readable(sf));
+		SLKQ_STAT_ADD(q, read_blocked_ns, ktime_get_ns() - start);
+		if (ret)
+			return ERR_PTR(ret);
+	}
+}
+
+/**
+ * slkq_dev_read_iter -- pops queue element which is triggered by reading
+ * /dev/slkq (or splicing from it)
+ *
+ * In SLKQ_MODE_BATCH as many whole records as fit into user buffer are
+ * popped under single q->out_fifo_lock acquisition (from single partition).
+ *
+ */
+static ssize_t slkq_dev_read_iter (struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct slkq_queue *q;
+	ssize_t ret = 0;
+	size_t len = iov_iter_count(to), copied = 0, rec, n;
+	struct slkq_fifo_msg m;
+	int batch = (slkq_file_mode(file) == SLKQ_MODE_BATCH);
+
+	q = slkq_out_lock(file->private_data, file->f_flags & O_NONBLOCK);
+	if (IS_ERR(q))
+		return PTR_ERR(q);
+
+	do {
+		/* Just peeking at this point because message size can be larger
+		 * than what's left of user provided buffer
+		 */
+		if (kfifo_peek(&q->msg_fifo, &m) != 1)
+			break;
+
+		rec = m.size + (batch ? SLKQ_REC_HDR_SIZE : 0);
+
+		if (rec > len - copied) {
+			if (!copied) {
+				dev_err(q->devp, "buffer is too small (%zu > %zu)\n",
+					rec, len);
+				ret = -EFAULT;
+			}
+			break;
+		}
+
+		/* record is copied whole or not at all: user buffer might
+		 * fault, pipe buffer might fail to be allocated on splice */
+		n = (batch) ? copy_to_iter(&m.size, SLKQ_REC_HDR_SIZE, to) : 0;
+		if (n == rec - m.size)
+			n += copy_to_iter(m.buf, m.size, to);
+
+		if (n != rec) {
+			dev_err(q->devp, "copy_to_iter failed\n");
+			iov_iter_revert(to, n);
+			ret = -EFAULT;
+			break;
+		}
+
+		/* Safe to skip at this point */
+		kfifo_skip(&q->msg_fifo);
+		slkq_stat_deq(q, &m);
+		slkq_msg_free(&m);
+		copied += rec;
+	} while (batch);
+
+	mutex_unlock(&q->out_fifo_lock);
+
+	/* records popped before failure made room too */
+	slkq_spool_kick(q);
+
+	wake_up_interruptible(&q->parent->msg_space_q);
+	slkq_stage_unblock(q);
+
+	/* records popped so far are gone, report them rather than error */
+	return (copied) ? (copied) : (ret);
+}
+
+/**
+ * slkq_dev_splice_read -- pops messages straight into pipe pages (through
+ * slkq_dev_read_iter), so they don't go through user space
+ *
+ * Length is limited to free space of pipe, so record is never split between
+ * pipe and FIFO. Record that fails to be copied halfway (pipe buffer
+ * allocation) is reverted, so pipe holds whole records only.
+ */
+static ssize_t slkq_dev_splice_read (struct file *file, loff_t *ppos,
+				     struct pipe_inode_info *pipe, size_t len,
+				     unsigned int flags)
+{
+	len = min_t(size_t, len, (pipe->buffers - pipe->nrbufs) << PAGE_SHIFT);
+	if (!len)
+		return -EAGAIN;
+
+	return generic_file_splice_read(file, ppos, pipe, len, flags);
+}
+
+/**
+ * slkq_msg_from_iter -- copies message out of write() buffer (or pipe
+ * buffers on splice) into new slab object
+ *
+ * 'from' is what's left of buffer: single message or, in batch mode,
+ * sequence of records. Returns number of bytes taken or error, 'from' is
+ * advanced past them.
+ */
+static ssize_t slkq_msg_from_iter (struct slkq_queue *q,
+				   struct iov_iter *from, int batch,
+				   struct slkq_fifo_msg *m)
+{
+	size_t len = iov_iter_count(from), hdr_size = 0, siz = len;
+	u_int16_t hdr;
+
+	if (batch) {
+		if (len < SLKQ_REC_HDR_SIZE)
+			return -EINVAL;
+
+		if (copy_from_iter(&hdr, SLKQ_REC_HDR_SIZE, from) !=
+		    SLKQ_REC_HDR_SIZE)
+			return -EFAULT;
+
+		siz = hdr;
+		hdr_size = SLKQ_REC_HDR_SIZE;
+
+		if (siz > len - SLKQ_REC_HDR_SIZE) {
+			dev_err(q->devp, "%s: truncated record\n", __func__);
+			return -EINVAL;
+		}
+	}
+
+	m->size = siz;
+	m->ts = ktime_get_ns();
+	m->buf = slkq_msg_alloc(siz);
+	if (!m->buf) {
+		dev_err(q->devp, "slkq_msg_alloc failed\n");
+		return -ENOMEM;
+	}
+
+	if (copy_from_iter(m->buf, siz, from) != siz) {
+		dev_err(q->devp, "user => kernel failed\n");
+		slkq_msg_free(m);
+		return -EFAULT;
+	}
+
+	return hdr_size + siz;
+}
+
+/**
+ * slkq_stage_put -- puts message into staging ring of current CPU
+ *
+ * Returns false if message has to take locked path (ring is full, or file's
+ * previous message is staged on another CPU and 'stage_ordered' is set).
+ */
+static bool slkq_stage_put (struct slkq_file *sf, struct slkq_queue *q,
+			    struct slkq_fifo_msg *m)
+{
+	int cpu, prev = sf->stage_cpu;
+	bool ret = false;
+
+	cpu = get_cpu();
+
+	if (stage_ordered && prev >= 0 && prev != cpu &&
+	    !kfifo_is_empty(&per_cpu_ptr(q->stage, prev)->fifo))
+		goto out;
+
+	ret = kfifo_put(&this_cpu_ptr(q->stage)->fifo, *m);
+	sf->stage_cpu = cpu;
+out:
+	put_cpu();
+	return ret;
+}
+
+/* slkq_stage_kick -- drains staged messages unless lock holder is to do it */
+static void slkq_stage_kick (struct slkq_queue *q)
+{
+	/* staged message is visible before lock is checked */
+	smp_mb();
+
+	if (mutex_trylock(&q->in_fifo_lock))
+		slkq_in_unlock(q);
+}
+
+/**
+ * slkq_stage_write -- stages messages of write() buffer, till buffer or
+ * staging ring is over, '*copied' is number of bytes staged
+ *
+ * Message that didn't fit is left in 'from' for locked path.
+ */
+static int slkq_stage_write (struct slkq_file *sf, struct slkq_queue *q,
+			     struct iov_iter *from, int batch, size_t *copied)
+{
+	struct iov_iter saved;
+	struct slkq_fifo_msg m;
+	ssize_t ret = 0;
+
+	while (iov_iter_count(from)) {
+		saved = *from;
+
+		ret = slkq_msg_from_iter(q, from, batch, &m);
+		if (ret < 0)
+			break;
+
+		if (!slkq_stage_put(sf, q, &m)) {
+			slkq_msg_free(&m);
+			*from = saved;
+			ret = 0;
+			break;
+		}
+
+		*copied += ret;
+		ret = 0;
+
+		if (!batch)
+			break;
+	}
+
+	if (*copied)
+		slkq_stage_kick(q);
+
+	return ret;
+}
+
+/**
+ * slkq_queue_writable -- whether push goes without waiting for flush or
+ * (SLKQ_FULL_BLOCK) for readers, i.e. message either fits into FIFO, gets
+ * dropped or fits into staging buffer (or buffer can be handed over)
+ */
+static inline bool slkq_queue_writable (struct slkq_queue *q)
+{
+	if (atomic_read(&q->spool_size) == 0) {
+		if (!kfifo_is_full(&q->msg_fifo))
+			return true;
+
+		switch (slkq_full_policy(q)) {
+		case SLKQ_FULL_BLOCK:
+			return false;
+		case SLKQ_FULL_DROP_OLDEST:
+		case SLKQ_FULL_DROP_NEWEST:
+			return true;
+		}
+	}
+
+	return !READ_ONCE(q->spool_fbuf_n) ||
+		READ_ONCE(q->spool_wbuf_used) + SLKQ_SPOOL_REC_HDR_SIZE +
+		SLKQ_MSG_MAX_SIZE <= SLKQ_SPOOL_WBUF_SIZE;
+}
+
+/**
+ * slkq_wait_space -- waits till push can go on (FIFO of queue with
+ * SLKQ_FULL_BLOCK policy has room or flush took staging buffer over),
+ * q->in_fifo_lock is released while waiting
+ *
+ * Returns 0 with lock down again, or error (-EAGAIN for O_NONBLOCK file)
+ * with lock released.
+ */
+static int slkq_wait_space (struct slkq_queue *q, struct file *file)
+{
+	u64 start;
+	int ret;
+
+	slkq_in_unlock(q);
+
+	/* readers make room, messages pushed so far must not wait for it */
+	wake_up_interruptible(&q->parent->msg_new_q);
+	slkq_spool_kick(q);
+
+	if (file->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+
+	start = ktime_get_ns();
+	ret = wait_event_interruptible(q->parent->msg_space_q,
+				       slkq_queue_writable(q));
+	SLKQ_STAT_ADD(q, write_blocked_ns, ktime_get_ns() - start);
+	if (ret)
+		return ret;
+
+	return mutex_lock_interruptible(&q->in_fifo_lock);
+}
+
+/**
+ * slkq_dev_write_iter -- push element to queue element which is trigerred by
+ * writing to /dev/slkq
+ *
+ * In SLKQ_MODE_BATCH buffer holds sequence of records which are all
+ * pushed under single q->in_fifo_lock acquisition. If error happens midway,
+ * short count (whole records only) is returned, so caller resubmits the rest.
+ *
+ * With per-CPU staging on, messages are staged first and locked path takes
+ * over for the rest once staging ring is full. Whole buffer goes to single
+ * partition.
+ *
+ * With SLKQ_FULL_BLOCK policy writer sleeps till FIFO has room, as it does
+ * while both staging buffers are full (O_NONBLOCK one gets short count or
+ * EAGAIN).
+ *
+ * It's write_iter, so splice() from pipe goes here too
+ * (iter_file_splice_write), pipe buffers are copied straight into messages.
+ */
+static ssize_t slkq_dev_write_iter (struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct slkq_file *sf = file->private_data;
+	struct slkq_queue *q = slkq_route(sf);
+	ssize_t ret;
+	size_t len = iov_iter_count(from), copied = 0, siz;
+	u64 start;
+	struct slkq_fifo_msg m;
+	int batch = (sf->mode == SLKQ_MODE_BATCH);
+
+	/* size must fit into u_int16_t (see struct slkq_fifo_msg) */
+	if (!batch && len >= SLKQ_MSG_MAX_SIZE) {
+		dev_err(q->devp, "%s: wrong len = %lu\n", __func__, len);
+		return -EINVAL;
+	}
+
+	if (batch && !len)
+		return 0;
+
+	if (iocb->ki_pos != 0) {
+		dev_err(q->devp, "%s: offset specified\n", __func__);
+		return -EINVAL;
+	}
+
+	if (q->stage && len) {
+		ret = slkq_stage_write(sf, q, from, batch, &copied);
+		if (ret || copied == len)
+			return (copied) ? (copied) : (ret);
+	}
+
+	ret = mutex_trylock(&q->in_fifo_lock);
+	if (ret == 0)
+		SLKQ_STAT_INC(q, in_contended);
+
+	if ((ret == 0) && (file->f_flags & O_NONBLOCK)) {
+		return (copied) ? (copied) : (-EAGAIN);
+	} else if (ret == 0) {
+		start = ktime_get_ns();
+		ret = mutex_lock_interruptible(&q->in_fifo_lock);
+		SLKQ_STAT_ADD(q, write_blocked_ns, ktime_get_ns() - start);
+		if (ret)
+			return (copied) ? (copied) : (ret);
+	}
+
+	/* staged messages go first, so order of each file is kept */
+	while ((ret = __stage_drain(q)) == -EAGAIN) {
+		ret = slkq_wait_space(q, file);
+		if (ret)
+			return (copied) ? (copied) : (ret);
+	}
+
+	if (ret < 0)
+		goto err1;
+
+	do {
+		ret = slkq_msg_from_iter(q, from, batch, &m);
+		if (ret < 0)
+			goto err1;
+
+		siz = ret;
+
+		while ((ret = __slkq_push(q, &m)) == -EAGAIN) {
+			ret = slkq_wait_space(q, file);
+			if (ret) {
+				slkq_msg_free(&m);
+				return (copied) ? (copied) : (ret);
+			}
+		}
+
+		if (ret)
+			goto err;
+
+		copied += siz;
+	} while (batch && copied < len);
+
+	slkq_spool_kick(q);
+
+	wake_up_interruptible(&q->parent->msg_new_q);
+	slkq_in_unlock(q);
+	return copied;
+
+err:
+	slkq_msg_free(&m);
+err1:
+	slkq_spool_kick(q);
+
+	if (copied)
+		wake_up_interruptible(&q->parent->msg_new_q);
+
+	slkq_in_unlock(q);
+
+	/* records pushed so far are queued, report them rather than error */
+	return (copied) ? (copied) : (ret);
+}
+
+/**
+ * slkq_ring_push -- pushes messages user placed into push ring
+ *
+ * Same as batch write(), but messages are taken from shared memory instead
+ * of user buffer (copy to slab object still happens). Returns number of
+ * messages pushed.
+ */
+static long slkq_ring_push (struct slkq_file *sf, struct slkq_ring *ring)
+{
+	struct slkq_ring_ctl *ctl = ring->ctl;
+	struct slkq_queue *q;
+	struct slkq_fifo_msg m;
+	unsigned char *slot;
+	long n = 0, ret = 0;
+	u32 tail;
+	u16 siz;
+
+	ret = mutex_lock_interruptible(&ring->push_lock);
+	if (ret)
+		return ret;
+
+	/* nothing to push (e.g. push_work polling idle ring) */
+	if (READ_ONCE(ctl->push_tail) == ring->push_head)
+		goto unlock_ring;
+
+	q = slkq_route(sf);
+
+	ret = mutex_lock_interruptible(&q->in_fifo_lock);
+	if (ret)
+		goto unlock_ring;
+
+	ret = __stage_drain(q);
+	if (ret < 0)
+		goto unlock;
+
+	ret = 0;
+	tail = smp_load_acquire(&ctl->push_tail);
+
+	if (tail - ring->push_head > ring->slots) {
+		dev_err(q->devp, "%s: bogus push_tail %u\n", __func__, tail);
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	while (ring->push_head != tail) {
+		slot = slkq_ring_slot(ring, ring->push_off, ring->push_head);
+		siz = READ_ONCE(*(u16 *)slot);
+
+		if (siz > ring->slot_size - SLKQ_REC_HDR_SIZE) {
+			dev_err(q->devp, "%s: bad record size %u\n", __func__, siz);
+			ret = -EINVAL;
+			break;
+		}
+
+		m.size = siz;
+		m.ts = ktime_get_ns();
+		m.buf = slkq_msg_alloc(siz);
+		if (!m.buf) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		memcpy(m.buf, slot + SLKQ_REC_HDR_SIZE, siz);
+
+		ret = __slkq_push(q, &m);
+		if (ret) {
+			slkq_msg_free(&m);
+			break;
+		}
+
+		ring->push_head++;
+		n++;
+	}
+
+	/* slots are free to reuse by user space */
+	smp_store_release(&ctl->push_head, ring->push_head);
+
+	slkq_spool_kick(q);
+
+	if (n)
+		wake_up_interruptible(&q->parent->msg_new_q);
+unlock:
+	slkq_in_unlock(q);
+unlock_ring:
+	mutex_unlock(&ring->push_lock);
+	return (n) ? (n) : (ret);
+}
+
+/**
+ * slkq_ring_push_work -- drains push ring of SLKQ_RING_POLL_PUSH file: right
+ * away again while producer keeps it busy, every jiffy once it's empty, till
+ * it's been empty for ring_idle_ms (or push fails, e.g. queue is full). Then
+ * sets SLKQ_RING_NEED_WAKEUP and leaves the rest to SLKQ_IOC_RING_PUSH.
+ */
+static void slkq_ring_push_work (struct work_struct *work)
+{
+	struct slkq_ring *ring = container_of(to_delayed_work(work),
+					      struct slkq_ring, push_work);
+	struct slkq_ring_ctl *ctl = ring->ctl;
+	long n;
+
+	n = slkq_ring_push(ring->sf, ring);
+	if (n > 0) {
+		ring->push_busy = jiffies;
+		queue_delayed_work(system_wq, &ring->push_work, 0);
+		return;
+	}
+
+	if (n == 0 && time_before(jiffies, ring->push_busy +
+				  msecs_to_jiffies(ring_idle_ms))) {
+		queue_delayed_work(system_wq, &ring->push_work, 1);
+		return;
+	}
+
+	WRITE_ONCE(ctl->push_flags, SLKQ_RING_NEED_WAKEUP);
+
+	/* pairs with barrier between producer's push_tail release and
+	 * push_flags load, so either producer sees the flag or push_tail it
+	 * released is seen here */
+	smp_mb();
+
+	if (n == 0 && READ_ONCE(ctl->push_tail) != READ_ONCE(ring->push_head)) {
+		WRITE_ONCE(ctl->push_flags, 0);
+		ring->push_busy = jiffies;
+		queue_delayed_work(system_wq, &ring->push_work, 0);
+	}
+}
+
+/* slkq_ring_push_kick -- (re)starts polling of push ring */
+static void slkq_ring_push_kick (struct slkq_ring *ring)
+{
+	WRITE_ONCE(ring->ctl->push_flags, 0);
+	ring->push_busy = jiffies;
+	queue_delayed_work(system_wq, &ring->push_work, 1);
+}
+
+/**
+ * slkq_ring_pop -- pops messages into pop ring
+ *
+ * Blocks (unless 'nonblock') till there is something to pop, returns number
+ * of messages placed into ring (zero if ring has no free slots). With
+ * SLKQ_RING_POLL_POP, ring left full while partition still has messages
+ * gets SLKQ_RING_NEED_WAKEUP in pop_flags.
+ */
+static long slkq_ring_pop (struct slkq_file *sf, struct slkq_ring *ring,
+			   bool nonblock)
+{
+	struct slkq_ring_ctl *ctl = ring->ctl;
+	struct slkq_queue *q;
+	struct slkq_fifo_msg m;
+	unsigned char *slot;
+	long n = 0, ret = 0;
+	u32 head;
+
+	q = slkq_out_lock(sf, nonblock);
+	if (IS_ERR(q))
+		return PTR_ERR(q);
+
+	mutex_lock(&ring->pop_lock);
+	WRITE_ONCE(ctl->pop_flags, 0);
+again:
+	head = smp_load_acquire(&ctl->pop_head);
+
+	if (ring->pop_tail - head > ring->slots) {
+		dev_err(q->devp, "%s: bogus pop_head %u\n", __func__, head);
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	while (ring->pop_tail - head < ring->slots &&
+	       kfifo_peek(&q->msg_fifo, &m)) {
+		if (m.size > ring->slot_size - SLKQ_REC_HDR_SIZE) {
+			ret = -EMSGSIZE;
+			break;
+		}
+
+		slot = slkq_ring_slot(ring, ring->pop_off, ring->pop_tail);
+		*(u16 *)slot = m.size;
+		memcpy(slot + SLKQ_REC_HDR_SIZE, m.buf, m.size);
+
+		kfifo_skip(&q->msg_fifo);
+		slkq_stat_deq(q, &m);
+		slkq_msg_free(&m);
+
+		ring->pop_tail++;
+		n++;
+	}
+
+	/* slots are filled before user space can see them */
+	smp_store_release(&ctl->pop_tail, ring->pop_tail);
+
+	if ((ring->flags & SLKQ_RING_POLL_POP) && !ret &&
+	    ring->pop_tail - head == ring->slots &&
+	    !kfifo_is_empty(&q->msg_fifo)) {
+		WRITE_ONCE(ctl->pop_flags, SLKQ_RING_NEED_WAKEUP);
+
+		/* pairs with barrier between consumer's pop_head release and
+		 * pop_flags load, so either consumer sees the flag or room
+		 * it made is seen here */
+		smp_mb();
+
+		if (READ_ONCE(ctl->pop_head) != head) {
+			WRITE_ONCE(ctl->pop_flags, 0);
+			goto again;
+		}
+	}
+unlock:
+	mutex_unlock(&ring->pop_lock);
+	mutex_unlock(&q->out_fifo_lock);
+
+	slkq_spool_kick(q);
+
+	if (n) {
+		wake_up_interruptible(&q->parent->msg_space_q);
+		slkq_stage_unblock(q);
+
+		if (ring->flags & SLKQ_RING_POLL_POP)
+			wake_up_interruptible(&ring->pop_wq);
+	}
+
+	return (n) ? (n) : (ret);
+}
+
+/**
+ * slkq_ring_pop_work -- fills pop ring of SLKQ_RING_POLL_POP file from
+ * whichever partitions have messages, without blocking
+ */
+static void slkq_ring_pop_work (struct work_struct *work)
+{
+	struct slkq_ring *ring = container_of(work, struct slkq_ring, pop_work);
+
+	while (slkq_ring_pop(ring->sf, ring, true) > 0)
+		cond_resched();
+}
+
+/* slkq_ring_pop_wake -- msg_new_q callback of SLKQ_RING_POLL_POP file */
+static int slkq_ring_pop_wake (wait_queue_entry_t *wait, unsigned int mode,
+			       int sync, void *key)
+{
+	struct slkq_ring *ring = container_of(wait, struct slkq_ring, pop_wait);
+
+	queue_work(system_wq, &ring->pop_work);
+
+	return 0;
+}
+
+/**
+ * slkq_ring_setup -- allocates shared memory rings for open file
+ *
+ * Rings are allocated once per file and live till file is released (mapping
+ * holds reference to file). SLKQ_RING_POLL_* flags have kernel drive them
+ * without ioctl()s (see slkq_ring_push_work, slkq_ring_pop_work).
+ */
+static int slkq_ring_setup (struct slkq_file *sf,
+			    struct slkq_ring_params __user *uparams)
+{
+	struct slkq_ring_params params;
+	struct slkq_ring *ring;
+	size_t ring_size, size;
+	int ret = 0;
+
+	if (copy_from_user(&params, uparams, sizeof(params)))
+		return -EFAULT;
+
+	if (!params.slots || !is_power_of_2(params.slots) ||
+	    params.slots > SLKQ_RING_SLOTS_MAX)
+		return -EINVAL;
+
+	if (params.flags & ~(SLKQ_RING_POLL_PUSH | SLKQ_RING_POLL_POP))
+		return -EINVAL;
+
+	if (params.slot_size <= SLKQ_REC_HDR_SIZE ||
+	    params.slot_size > SLKQ_MSG_MAX_SIZE + SLKQ_REC_HDR_SIZE)
+		return -EINVAL;
+
+	params.slot_size = ALIGN(params.slot_size, 8);
+	ring_size = PAGE_ALIGN((size_t)params.slots * params.slot_size);
+	size = PAGE_SIZE + 2 * ring_size;
+
+	if (size > SLKQ_RING_SIZE_MAX)
+		return -EINVAL;
+
+	mutex_lock(&sf->lock);
+
+	if (sf->ring) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	ring->mem = vmalloc_user(size);
+	if (!ring->mem) {
+		kfree(ring);
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	ring->size = size;
+	ring->ctl = ring->mem;
+	ring->slots = params.slots;
+	ring->slot_size = params.slot_size;
+	ring->push_off = PAGE_SIZE;
+	ring->pop_off = PAGE_SIZE + ring_size;
+	ring->flags = params.flags;
+	ring->sf = sf;
+	mutex_init(&ring->push_lock);
+	mutex_init(&ring->pop_lock);
+	INIT_DELAYED_WORK(&ring->push_work, slkq_ring_push_work);
+	INIT_WORK(&ring->pop_work, slkq_ring_pop_work);
+	init_waitqueue_func_entry(&ring->pop_wait, slkq_ring_pop_wake);
+	init_waitqueue_head(&ring->pop_wq);
+
+	/* first push has to start polling */
+	if (ring->flags & SLKQ_RING_POLL_PUSH)
+		ring->ctl->push_flags = SLKQ_RING_NEED_WAKEUP;
+
+	params.push_off = ring->push_off;
+	params.pop_off = ring->pop_off;
+	params.size = size;
+
+	if (copy_to_user(uparams, &params, sizeof(params))) {
+		vfree(ring->mem);
+		kfree(ring);
+		ret = -EFAULT;
+		goto unlock;
+	}
+
+	/* ring is complete before push/pop can see it */
+	smp_store_release(&sf->ring, ring);
+
+	if (ring->flags & SLKQ_RING_POLL_POP) {
+		add_wait_queue(&sf->q->msg_new_q, &ring->pop_wait);
+
+		/* messages queued before setup */
+		queue_work(system_wq, &ring->pop_work);
+	}
+
+	dev_dbg(sf->q->devp, "%s: %u slots of %u bytes\n", __func__, ring->slots,
+		ring->slot_size);
+unlock:
+	mutex_unlock(&sf->lock);
+	return ret;
+}
+
+/**
+ * slkq_group_join -- makes file member of queue's consumer group, partitions
+ * get reassigned among members (see slkq_part_assigned)
+ */
+static void slkq_group_join (struct slkq_file *sf)
+{
+	struct slkq_queue *q = sf->q;
+
+	mutex_lock(&q->group_lock);
+
+	if (sf->member_idx < 0) {
+		list_add_tail(&sf->member, &q->members);
+		WRITE_ONCE(q->nmembers, q->nmembers + 1);
+		WRITE_ONCE(sf->member_idx, q->nmembers - 1);
+	}
+
+	mutex_unlock(&q->group_lock);
+}
+
+/* slkq_group_leave -- removes file from consumer group and rebalances it */
+static void slkq_group_leave (struct slkq_file *sf)
+{
+	struct slkq_queue *q = sf->q;
+	struct slkq_file *m;
+	int idx = 0;
+
+	if (sf->member_idx < 0)
+		return;
+
+	mutex_lock(&q->group_lock);
+
+	list_del(&sf->member);
+	sf->member_idx = -1;
+
+	list_for_each_entry(m, &q->members, member)
+		WRITE_ONCE(m->member_idx, idx++);
+
+	WRITE_ONCE(q->nmembers, idx);
+
+	mutex_unlock(&q->group_lock);
+
+	/* members waiting might have got partitions of one that left */
+	wake_up_interruptible(&q->msg_new_q);
+}
+
+static int slkq_queue_create (const char *name, unsigned int nparts,
+			      unsigned int flags);
+static int slkq_queue_destroy (const char *name);
+
+/**
+ * slkq_dev_ioctl -- switches open file between single-message and batch
+ * modes, sets up and drives shared memory rings, routes writes and joins
+ * consumer group of partitioned queue, creates and destroys named queues
+ * (see SLKQ_IOC_* in common/slkq.h)
+ */
+static long slkq_dev_ioctl (struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct slkq_file *sf = file->private_data;
+	struct slkq_queue_params qp;
+	struct slkq_ring *ring;
+	int mode, policy;
+	long ret;
+	u32 key;
+
+	switch (cmd) {
+	case SLKQ_IOC_SET_MODE:
+		if (get_user(mode, (int __user *)arg))
+			return -EFAULT;
+
+		if (mode != SLKQ_MODE_SINGLE && mode != SLKQ_MODE_BATCH)
+			return -EINVAL;
+
+		sf->mode = mode;
+		return 0;
+	case SLKQ_IOC_GET_MODE:
+		return put_user(sf->mode, (int __user *)arg);
+	case SLKQ_IOC_RING_SETUP:
+		return slkq_ring_setup(sf, (void __user *)arg);
+	case SLKQ_IOC_RING_PUSH:
+	case SLKQ_IOC_RING_POP:
+		ring = smp_load_acquire(&sf->ring);
+		if (!ring)
+			return -EINVAL;
+
+		if (cmd == SLKQ_IOC_RING_POP)
+			return slkq_ring_pop(sf, ring,
+					     file->f_flags & O_NONBLOCK);
+
+		ret = slkq_ring_push(sf, ring);
+
+		if (ring->flags & SLKQ_RING_POLL_PUSH)
+			slkq_ring_push_kick(ring);
+
+		return ret;
+	case SLKQ_IOC_SET_KEY:
+		if (get_user(key, (u32 __user *)arg))
+			return -EFAULT;
+
+		sf->key = key;
+		sf->keyed = true;
+		return 0;
+	case SLKQ_IOC_GROUP_JOIN:
+		slkq_group_join(sf);
+		return 0;
+	case SLKQ_IOC_SET_FULL_POLICY:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		if (get_user(policy, (int __user *)arg))
+			return -EFAULT;
+
+		if (policy < 0 || policy >= ARRAY_SIZE(full_policy_names))
+			return -EINVAL;
+
+		WRITE_ONCE(sf->q->full_policy, policy);
+
+		/* writers blocked by previous policy may go on now */
+		wake_up_interruptible(&sf->q->msg_space_q);
+		return 0;
+	case SLKQ_IOC_GET_FULL_POLICY:
+		return put_user(slkq_full_policy(sf->q), (int __user *)arg);
+	case SLKQ_IOC_QUEUE_CREATE:
+	case SLKQ_IOC_QUEUE_DESTROY:
+		if (sf->q->minor != 0)
+			return -ENOTTY;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		if (copy_from_user(&qp, (void __user *)arg, sizeof(qp)))
+			return -EFAULT;
+
+		if (cmd == SLKQ_IOC_QUEUE_CREATE)
+			return slkq_queue_create(qp.name, qp.partitions, qp.flags);
+
+		return slkq_queue_destroy(qp.name);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/**
+ * slkq_dev_poll -- queue is readable once FIFO has something to pop
+ * (msg_new_q), or with SLKQ_RING_POLL_POP once pop ring isn't empty
+ * (pop_wq), writable while push doesn't have to wait for spool write out
+ * (msg_space_q)
+ */
+static unsigned int slkq_dev_poll (struct file *file, poll_table *wait)
+{
+	struct slkq_file *sf = file->private_data;
+	struct slkq_ring *ring = smp_load_acquire(&sf->ring);
+	struct slkq_queue *q = sf->q;
+	unsigned int mask = 0, i;
+
+	poll_wait(file, &q->msg_new_q, wait);
+	poll_wait(file, &q->msg_space_q, wait);
+
+	if (ring && (ring->flags & SLKQ_RING_POLL_POP)) {
+		/* kernel moves messages into pop ring on its own */
+		poll_wait(file, &ring->pop_wq, wait);
+
+		if (READ_ONCE(ring->pop_tail) != READ_ONCE(ring->ctl->pop_head))
+			mask |= POLLIN | POLLRDNORM;
+	} else if (slkq_parts_readable(sf)) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+
+	/* keyed writes go to one partition, round robin ones to any */
+	if (sf->keyed) {
+		if (slkq_queue_writable(q->parts[slkq_key_part(q, sf->key)]))
+			mask |= POLLOUT | POLLWRNORM;
+	} else {
+		for (i = 0; i < q->nparts; i++) {
+			if (slkq_queue_writable(q->parts[i])) {
+				mask |= POLLOUT | POLLWRNORM;
+				break;
+			}
+		}
+	}
+
+	return mask;
+}
+
+/* slkq_dev_mmap -- maps rings set up by SLKQ_IOC_RING_SETUP */
+static int slkq_dev_mmap (struct file *file, struct vm_area_struct *vma)
+{
+	struct slkq_file *sf = file->private_data;
+	struct slkq_ring *ring = smp_load_acquire(&sf->ring);
+
+	if (!ring)
+		return -EINVAL;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+static int slkq_dev_open (struct inode *inode, struct file *file)
+{
+	struct slkq_file *sf;
+
+	sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+	if (!sf)
+		return -ENOMEM;
+
+	/* queue can't go away while it's open (see slkq_queue_destroy) */
+	mutex_lock(&slkq_queues_lock);
+
+	sf->q = idr_find(&slkq_queues, iminor(inode));
+	if (sf->q)
+		sf->q->users++;
+
+	mutex_unlock(&slkq_queues_lock);
+
+	if (!sf->q) {
+		kfree(sf);
+		return -ENODEV;
+	}
+
+	sf->mode = SLKQ_MODE_SINGLE;
+	sf->stage_cpu = -1;
+	sf->member_idx = -1;
+	INIT_LIST_HEAD(&sf->member);
+	mutex_init(&sf->lock);
+	file->private_data = sf;
+
+	return 0;
+}
+
+static int slkq_dev_release (struct inode *inode, struct file *file)
+{
+	struct slkq_file *sf = file->private_data;
+
+	if (sf->ring) {
+		if (sf->ring->flags & SLKQ_RING_POLL_POP)
+			remove_wait_queue(&sf->q->msg_new_q,
+					  &sf->ring->pop_wait);
+
+		cancel_work_sync(&sf->ring->pop_work);
+		cancel_delayed_work_sync(&sf->ring->push_work);
+
+		vfree(sf->ring->mem);
+		kfree(sf->ring);
+	}
+
+	slkq_group_leave(sf);
+
+	mutex_lock(&slkq_queues_lock);
+	sf->q->users--;
+	mutex_unlock(&slkq_queues_lock);
+
+	kfree(sf);
+
+	return 0;
+}
+
+static const struct file_operations slkq_dev_ops = {
+        .owner = THIS_MODULE,
+        .write_iter = slkq_dev_write_iter,
+        .read_iter = slkq_dev_read_iter,
+        .splice_read = slkq_dev_splice_read,
+        .splice_write = iter_file_splice_write,
+        .unlocked_ioctl = slkq_dev_ioctl,
+        .compat_ioctl = slkq_dev_ioctl,
+        .mmap = slkq_dev_mmap,
+        .poll = slkq_dev_poll,
+        .open = slkq_dev_open,
+        .release = slkq_dev_release,
+};
+
+/**
+ * slkq_status_read -- return status string that is accessed by reading
+ * /proc/slkq_status entry (/proc/slkq_status-<name> for named queue),
+ * numbers of partitioned queue are sums over partitions
+ *
+ * Status string consists of 4 numbers: used elements, free elements, total elements,
+ * spool size. E.g.
+ *
+ * $ cat /proc/slkq_status
+ * 768 256 1024 259
+ *
+ * There is in-kernel queue with total of 1024 elements (768 used, 256 free), and on-disk
+ * spool holds 259 elements
+ */
+static ssize_t slkq_status_read (struct file *file, char __user *ubuf,
+				 size_t count, loff_t *off)
+{
+	struct slkq_queue *q = PDE_DATA(file_inode(file)), *p;
+	unsigned int used = 0, avail = 0, size = 0, i;
+	int spooled = 0;
+	char buf[128];
+	int len = 0;
+
+	if (*off) {
+		return 0;
+	}
+
+	for (i = 0; i < q->nparts; i++) {
+		p = q->parts[i];
+		used += kfifo_len(&p->msg_fifo);
+		avail += kfifo_avail(&p->msg_fifo);
+		size += kfifo_size(&p->msg_fifo);
+		spooled += atomic_read(&p->spool_size);
+	}
+
+	len += sprintf(buf, "%u %u %u %d\n", used, avail, size, spooled);
+
+	if (copy_to_user(ubuf, buf, len)) {
+		return -EFAULT;
+	}
+
+	*off = len;
+
+	return len;
+}
+
+static const struct file_operations slkq_status_ops = {
+	.owner = THIS_MODULE,
+	.read = slkq_status_read,
+};
+
+/* slkq_stats_sum -- sums counters over CPUs and partitions of queue 'q' */
+static void slkq_stats_sum (struct slkq_queue *q, struct slkq_stats *sum)
+{
+	u64 *dst = (u64 *)sum, *src;
+	unsigned int i, k;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (i = 0; i < q->nparts; i++) {
+		for_each_possible_cpu(cpu) {
+			src = (u64 *)per_cpu_ptr(q->parts[i]->stats, cpu);
+
+			for (k = 0; k < sizeof(*sum) / sizeof(u64); k++)
+				dst[k] += READ_ONCE(src[k]);
+		}
+	}
+}
+
+static int slkq_stats_show (struct seq_file *m, void *v)
+{
+	struct slkq_queue *q = m->private;
+	struct slkq_stats st;
+
+	slkq_stats_sum(q, &st);
+
+	seq_printf(m, "enq %llu\n", st.enq);
+	seq_printf(m, "enq_bytes %llu\n", st.enq_bytes);
+	seq_printf(m, "deq %llu\n", st.deq);
+	seq_printf(m, "deq_bytes %llu\n", st.deq_bytes);
+	seq_printf(m, "spill %llu\n", st.spill);
+	seq_printf(m, "spill_bytes %llu\n", st.spill_bytes);
+	seq_printf(m, "load %llu\n", st.load);
+	seq_printf(m, "load_bytes %llu\n", st.load_bytes);
+	seq_printf(m, "flush %llu\n", st.flush);
+	seq_printf(m, "flush_bytes %llu\n", st.flush_bytes);
+	seq_printf(m, "seg_reclaim %llu\n", st.seg_reclaim);
+	seq_printf(m, "compress_in %llu\n", st.compress_in);
+	seq_printf(m, "compress_out %llu\n", st.compress_out);
+	seq_printf(m, "compress_ratio_pct %llu\n", (st.compress_out) ?
+		   (div64_u64(st.compress_in * 100, st.compress_out)) : (0));
+	seq_printf(m, "compress_ns %llu\n", st.compress_ns);
+	seq_printf(m, "decompress_ns %llu\n", st.decompress_ns);
+	seq_printf(m, "in_contended %llu\n", st.in_contended);
+	seq_printf(m, "out_contended %llu\n", st.out_contended);
+	seq_printf(m, "write_blocked_ns %llu\n", st.write_blocked_ns);
+	seq_printf(m, "read_blocked_ns %llu\n", st.read_blocked_ns);
+	seq_printf(m, "drop_oldest %llu\n", st.drop_oldest);
+	seq_printf(m, "drop_newest %llu\n", st.drop_newest);
+
+	return 0;
+}
+
+static int slkq_histograms_show (struct seq_file *m, void *v)
+{
+	struct slkq_queue *q = m->private;
+	struct slkq_stats st;
+	unsigned int b;
+
+	slkq_stats_sum(q, &st);
+
+	seq_puts(m, "usecs residence flush\n");
+
+	for (b = 0; b < SLKQ_HIST_BUCKETS; b++) {
+		if (!st.residence[b] && !st.flush_lat[b])
+			continue;
+
+		seq_printf(m, "%llu %llu %llu\n", (b) ? (1ULL << (b - 1)) : 0,
+			   st.residence[b], st.flush_lat[b]);
+	}
+
+	return 0;
+}
+
+static int slkq_stats_open (struct inode *inode, struct file *file)
+{
+	return single_open(file, slkq_stats_show, inode->i_private);
+}
+
+static int slkq_histograms_open (struct inode *inode, struct file *file)
+{
+	return single_open(file, slkq_histograms_show, inode->i_private);
+}
+
+static const struct file_operations slkq_stats_ops = {
+	.owner = THIS_MODULE,
+	.open = slkq_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations slkq_histograms_ops = {
+	.owner = THIS_MODULE,
+	.open = slkq_histograms_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * slkq_spool_load_work -- streams spool back into FIFO once it drained below
+ * SLKQ_FIFO_EXTEND_LIMIT
+ *
+ * Failed load is logged and retried later, what's in FIFO is still served.
+ */
+static void slkq_spool_load_work (struct work_struct *work)
+{
+	struct slkq_queue *q = container_of(to_delayed_work(work),
+					    struct slkq_queue, spool_load_work);
+	int ret;
+
+	if (!SLKQ_FIFO_EXTEND_COND(q))
+		return;
+
+	dev_dbg(q->devp, "%s: going to load\n", __func__);
+
+	mutex_lock(&q->spool_load_lock);
+	ret = __load_from_spool(q);
+	mutex_unlock(&q->spool_load_lock);
+
+	/* readers might be waiting on empty FIFO */
+	wake_up_interruptible(&q->parent->msg_new_q);
+
+	if (ret) {
+		dev_err_ratelimited(q->devp, "%s: load_from_spool() failed (%d)\n",
+				    __func__, ret);
+		slkq_spool_queue(q, &q->spool_load_work, HZ);
+		return;
+	}
+
+	/* staging buffer might have been left to loader */
+	if (SLKQ_SPOOL_FLUSH_COND(q))
+		slkq_spool_queue(q, &q->spool_flush_work, 0);
+
+	mutex_lock(&q->spool_load_lock);
+	__spool_prefetch(q);
+	mutex_unlock(&q->spool_load_lock);
+}
+
+/**
+ * slkq_spool_flush_work -- writes staging buffer out to spool
+ *
+ * Records that failed to get written stay in flight and are retried later,
+ * writers wait (or get -EAGAIN) once staging buffer is full meanwhile.
+ */
+static void slkq_spool_flush_work (struct work_struct *work)
+{
+	struct slkq_queue *q = container_of(to_delayed_work(work),
+					    struct slkq_queue, spool_flush_work);
+
+	dev_dbg(q->devp, "%s: going to flush\n", __func__);
+
+	if (__spool_flush(q, false)) {
+		slkq_spool_queue(q, &q->spool_flush_work, HZ);
+		return;
+	}
+
+	/* writers waiting for staging buffer go on */
+	wake_up_interruptible(&q->parent->msg_space_q);
+
+	/* records written are there to load (writers requeue flush themselves) */
+	if (SLKQ_FIFO_EXTEND_COND(q))
+		slkq_spool_queue(q, &q->spool_load_work, 0);
+}
+
+/**
+ * slkq_spool_sync_work -- makes spool data and checkpoint durable according
+ * to 'spool_sync' policy ('none' policy writes checkpoint without syncing)
+ *
+ * State (position of records loaded into FIFO) is taken under
+ * q->in_fifo_lock, fsync and checkpoint write go with it released.
+ */
+static void slkq_spool_sync_work (struct work_struct *work)
+{
+	struct slkq_queue *q = container_of(to_delayed_work(work),
+					    struct slkq_queue, spool_sync_work);
+	bool sync = (spool_sync != SLKQ_SPOOL_SYNC_NONE), ckpt;
+	struct file *f = NULL;
+	unsigned int skip;
+	loff_t pos;
+	u64 seq;
+
+	mutex_lock(&q->in_fifo_lock);
+
+	if (q->spool_dirty && sync)
+		f = get_file(q->spool_tail_f);
+
+	ckpt = q->spool_ckpt_dirty;
+	seq = q->spool_head_seq;
+	pos = q->spool_done_pos;
+	skip = q->spool_done_skip;
+
+	q->spool_dirty = q->spool_ckpt_dirty = false;
+
+	slkq_in_unlock(q);
+
+	if (f) {
+		if (vfs_fsync(f, 1))
+			dev_err(q->devp, "%s: vfs_fsync failed\n", __func__);
+		fput(f);
+	}
+
+	if (!ckpt)
+		return;
+
+	mutex_lock(&q->spool_ckpt_lock);
+
+	/* __spool_advance might have moved checkpoint past 'seq' meanwhile */
+	if (seq >= q->spool_ckpt_seq)
+		__spool_checkpoint(q, seq, pos, skip, sync);
+
+	mutex_unlock(&q->spool_ckpt_lock);
+}
+
+static void slkq_msg_caches_destroy (void)
+{
+	int i;
+
+	for (i = 0; i < SLKQ_MSG_CLASSES; i++) {
+		kmem_cache_destroy(msg_cache[i]);
+		msg_cache[i] = NULL;
+	}
+}
+
+static int slkq_msg_caches_create (void)
+{
+	int i;
+
+	for (i = 0; i < SLKQ_MSG_CLASSES; i++) {
+		unsigned int size = 1 << (SLKQ_MSG_CLASS_MIN_SHIFT + i);
+
+		snprintf(msg_cache_name[i], sizeof(msg_cache_name[i]), "%s-%u",
+			 SLKQ_NAME, size);
+		msg_cache[i] = kmem_cache_create(msg_cache_name[i], size, 0, 0,
+						 NULL);
+
+		if (!msg_cache[i]) {
+			slkq_msg_caches_destroy();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void slkq_spool_bufs_destroy (struct slkq_queue *q)
+{
+	vfree(q->spool_lmsg);
+	vfree(q->spool_lz4_wrk);
+	vfree(q->spool_cbuf);
+	vfree(q->spool_zbuf);
+	vfree(q->spool_rbuf[1].buf);
+	vfree(q->spool_rbuf[0].buf);
+	vfree(q->spool_fbuf);
+	vfree(q->spool_wbuf);
+}
+
+static int slkq_spool_bufs_create (struct slkq_queue *q)
+{
+	q->spool_wbuf = vmalloc(SLKQ_SPOOL_WBUF_SIZE);
+	q->spool_fbuf = vmalloc(SLKQ_SPOOL_WBUF_SIZE);
+	q->spool_rbuf[0].buf = vmalloc(SLKQ_SPOOL_RBUF_SIZE);
+	q->spool_rbuf[1].buf = vmalloc(SLKQ_SPOOL_RBUF_SIZE);
+	/* spool may have frames even if compression is off now */
+	q->spool_zbuf = vmalloc(SLKQ_SPOOL_WBUF_SIZE);
+	q->spool_lmsg = vmalloc(SLKQ_SPOOL_LOAD_BATCH * sizeof(*q->spool_lmsg));
+
+	if (!q->spool_wbuf || !q->spool_fbuf || !q->spool_rbuf[0].buf ||
+	    !q->spool_rbuf[1].buf || !q->spool_zbuf || !q->spool_lmsg) {
+		slkq_spool_bufs_destroy(q);
+		return -ENOMEM;
+	}
+
+	if (!q->spool_compress)
+		return 0;
+
+	q->spool_cbuf = vmalloc(SLKQ_SPOOL_FRAME_HDR_SIZE +
+				LZ4_COMPRESSBOUND(SLKQ_SPOOL_WBUF_SIZE));
+	q->spool_lz4_wrk = vmalloc(LZ4_MEM_COMPRESS);
+
+	if (!q->spool_cbuf || !q->spool_lz4_wrk) {
+		slkq_spool_bufs_destroy(q);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void slkq_stage_destroy (struct slkq_queue *q)
+{
+	int cpu;
+
+	if (!q->stage)
+		return;
+
+	for_each_possible_cpu(cpu)
+		kfifo_free(&per_cpu_ptr(q->stage, cpu)->fifo);
+
+	free_percpu(q->stage);
+	q->stage = NULL;
+}
+
+static int slkq_stage_create (struct slkq_queue *q)
+{
+	int cpu;
+
+	if (!stage_length)
+		return 0;
+
+	q->stage = alloc_percpu(struct slkq_stage);
+	if (!q->stage)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		if (kfifo_alloc(&per_cpu_ptr(q->stage, cpu)->fifo, stage_length,
+				GFP_KERNEL)) {
+			slkq_stage_destroy(q);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * slkq_spool_scan -- validates records of segment 'f' from 'pos' on
+ *
+ * Stores offset past last valid record to 'end' and number of valid records
+ * to 'n'. Returns true if whole segment is valid.
+ */
+static bool slkq_spool_scan (struct slkq_queue *q, struct file *f, loff_t pos, loff_t *end,
+			     unsigned int *n)
+{
+	unsigned char *buf = q->spool_rbuf[0].buf;
+	loff_t size = i_size_read(file_inode(f));
+	struct slkq_spool_frame fr;
+	u_int16_t siz;
+	u32 crc;
+	size_t p, len, rec;
+	int ret;
+
+	*n = 0;
+
+	while (pos < size) {
+		ret = kernel_read(f, pos, buf,
+				  min_t(loff_t, SLKQ_SPOOL_RBUF_SIZE, size - pos));
+		if (ret <= 0)
+			break;
+
+		len = ret;
+
+		for (p = 0; p + SLKQ_SPOOL_REC_HDR_SIZE <= len; p += rec) {
+			memcpy(&siz, buf + p, sizeof(siz));
+			memcpy(&crc, buf + p + sizeof(siz), sizeof(crc));
+
+			if (!siz && crc == SLKQ_SPOOL_FRAME_MAGIC) {
+				if (p + SLKQ_SPOOL_FRAME_HDR_SIZE > len)
+					break;
+
+				memcpy(&fr, buf + p, sizeof(fr));
+				rec = SLKQ_SPOOL_FRAME_HDR_SIZE + fr.clen;
+
+				if (rec > SLKQ_SPOOL_RBUF_SIZE ||
+				    fr.rlen > SLKQ_SPOOL_WBUF_SIZE) {
+					*end = pos + p;
+					return false;
+				}
+
+				if (p + rec > len)
+					break;
+
+				/* frame isn't decompressed, its CRC is enough */
+				if (crc32c(~0, buf + p + SLKQ_SPOOL_FRAME_HDR_SIZE,
+					   fr.clen) != fr.crc) {
+					*end = pos + p;
+					return false;
+				}
+
+				*n += fr.n;
+				continue;
+			}
+
+			rec = SLKQ_SPOOL_REC_HDR_SIZE + siz;
+
+			if (p + rec > len)
+				break;
+
+			if (crc32c(~0, buf + p + SLKQ_SPOOL_REC_HDR_SIZE, siz) != crc) {
+				*end = pos + p;
+				return false;
+			}
+
+			(*n)++;
+		}
+
+		/* record doesn't fit into what's left of file */
+		if (!p)
+			break;
+
+		pos += p;
+	}
+
+	*end = pos;
+	return (pos == size);
+}
 
 /**
- * __unload_to_spool -- shrinks in-kernel queue by moving elements to disk spool
+ * slkq_spool_recover -- opens spool left by previous run (or creates new one)
  *
- * Must be called with out_fifo_lock down (race with slkq_dev_read)
+ * Segments are validated starting from checkpointed position, spool ends at
+ * first torn or corrupted record (tail segment is truncated there, following
+ * segments if any are removed).
  */
-static ssize_t __unload_to_spool (void)
+static int slkq_spool_recover (struct slkq_queue *q)
 {
-	ssize_t ret = 0;
-	struct slkq_fifo_msg m;
-	loff_t pos;
+	struct slkq_spool_ckpt c;
+	struct file *f, *next;
+	char name[96];
+	unsigned int n;
+	loff_t end, size;
+	bool valid;
+	u64 seq, s;
 
-	dev_dbg(devp, "shrinking to %d\n", SLKQ_FIFO_SHRINK_TO);
+	snprintf(name, sizeof(name), "%s.ckpt", q->prefix);
 
-	while (kfifo_len(&msg_fifo) > SLKQ_FIFO_SHRINK_TO && kfifo_get(&msg_fifo, &m)) {
-		pos = vfs_llseek(spool_f, 0, SEEK_END);
+	q->spool_ckpt_f = filp_open(name, O_RDWR | O_CREAT, 0600);
+	if (IS_ERR(q->spool_ckpt_f))
+		return PTR_ERR(q->spool_ckpt_f);
 
-		/**
-		 * Spool file uses variable record format where the record's first two
-		 * bytes indicate the length of the record.
-		 */
-		ret = kernel_write(spool_f, (char *)&(m.size), 2, pos);
-		if (ret != 2) {
-			dev_err(devp, "%s\n", __func__);
-			if (ret > 0)
-				ret = -ENOMEM;
-			ret = -1;
-			break;
+	if (kernel_read(q->spool_ckpt_f, 0, (char *)&c, sizeof(c)) != sizeof(c) ||
+	    c.magic != SLKQ_SPOOL_CKPT_MAGIC ||
+	    c.crc != crc32c(~0, &c, offsetof(struct slkq_spool_ckpt, crc))) {
+		pr_info("%s: no valid checkpoint, new spool\n", __func__);
+		c.head_seq = SLKQ_SPOOL_SEQ_BASE;
+		c.head_pos = 0;
+		c.head_skip = 0;
+	}
+
+	/* leftover of interrupted __spool_advance(q) */
+	f = __spool_seg_open(q, c.head_seq - 1, 0);
+	if (!IS_ERR(f)) {
+		__spool_seg_unlink(f);
+		filp_close(f, NULL);
+	}
+
+	seq = c.head_seq;
+	q->spool_pos = c.head_pos;
+	q->spool_zskip = c.head_skip;
+
+	f = __spool_seg_open(q, seq, 0);
+	if (IS_ERR(f)) {
+		q->spool_pos = 0;
+		q->spool_zskip = 0;
+		f = __spool_seg_open(q, seq, O_CREAT | O_TRUNC);
+		if (IS_ERR(f)) {
+			filp_close(q->spool_ckpt_f, NULL);
+			return PTR_ERR(f);
 		}
+	}
+
+	/* checkpoint got to disk, data it points to (or into) didn't:
+	 * truncating to it would leave a hole that fails CRC on every load */
+	size = i_size_read(file_inode(f));
+	if (q->spool_pos > size || (q->spool_pos == size && q->spool_zskip)) {
+		pr_err("%s: checkpoint %llx:%lld is past end of segment\n",
+		       __func__, seq, q->spool_pos);
+		q->spool_pos = size;
+		q->spool_zskip = 0;
+	}
+
+	q->spool_head_f = f;
+	q->spool_head_seq = seq;
+	q->spool_disk_n = 0;
 
-		pos += 2;
-		ret = kernel_write(spool_f, m.buf, m.size, pos);
+	for (;;) {
+		valid = slkq_spool_scan(q, f, (f == q->spool_head_f) ? q->spool_pos : 0,
+					&end, &n);
+		q->spool_disk_n += n;
 
-		if (ret != m.size) {
-			dev_err(devp, "%s\n", __func__);
-			if (ret > 0)
-				ret = -ENOMEM;
-			ret = -1;
+		next = valid ? __spool_seg_open(q, seq + 1, 0) : ERR_PTR(-ENOENT);
+		if (IS_ERR(next))
 			break;
-		}
 
-		atomic_inc(&spool_size);
-		ret = 0;
+		if (f != q->spool_head_f)
+			filp_close(f, NULL);
+
+		f = next;
+		seq++;
 	}
 
-	dev_dbg(devp, "unload done, %u\n", kfifo_len(&msg_fifo));
+	if (!valid) {
+		pr_err("%s: spool ends at %llx:%lld\n", __func__, seq, end);
+		vfs_truncate(&f->f_path, end);
 
-	kmem_cache_free(msg_cache, m.buf);
-	return ret;
+		/* records past damaged one can't be delivered in order */
+		for (s = seq + 1; !IS_ERR(next = __spool_seg_open(q, s, 0)); s++) {
+			__spool_seg_unlink(next);
+			filp_close(next, NULL);
+		}
+	}
+
+	/* scan counted whole head frame */
+	if (q->spool_zskip > q->spool_disk_n)
+		q->spool_zskip = q->spool_disk_n;
+	q->spool_disk_n -= q->spool_zskip;
+	q->spool_done_pos = q->spool_pos;
+	q->spool_done_skip = q->spool_zskip;
+
+	q->spool_tail_f = f;
+	q->spool_tail_seq = seq;
+	q->spool_tail_size = end;
+	atomic_set(&q->spool_size, q->spool_disk_n);
+
+	vfs_fallocate(q->spool_tail_f, FALLOC_FL_KEEP_SIZE, 0, spool_seg_size);
+
+	/* checkpoint of new spool */
+	q->spool_ckpt_dirty = true;
+
+	pr_info("%s: %u records in spool\n", __func__, q->spool_disk_n);
+
+	return 0;
 }
 
 /**
- * __load_from_spool -- loads messages to queue from disk spool
+ * __spool_save_head -- appends unconsumed part of head segment (rest of
+ * frame being loaded, then whatever follows it) to 'f' at '*pos'
  *
- * Must be called with in_fifo_lock down (race with slkq_dev_write)
+ * Must be called with q->spool_load_lock and q->in_fifo_lock down
  */
-static int __load_from_spool (void)
+static int __spool_save_head (struct slkq_queue *q, struct file *f, loff_t *pos)
 {
-	u_int16_t siz;
-	struct slkq_fifo_msg m;
+	unsigned char *buf = q->spool_rbuf[0].buf;
+	loff_t off, end = __spool_head_end(q, q->spool_tail_seq,
+					   q->spool_tail_size);
+	size_t len;
+	ssize_t ret;
 
-	dev_dbg(devp, "extend_to = %d, len = %d, spool_size = %d\n",
-		SLKQ_FIFO_EXTEND_TO, kfifo_len(&msg_fifo), atomic_read(&spool_size));
+	/* checkpointed position within frame that isn't loaded yet */
+	if (!q->spool_zlen && q->spool_zskip && __spool_frame_load(q))
+		return -EIO;
 
-	while ((kfifo_len(&msg_fifo) < SLKQ_FIFO_EXTEND_TO) &&
-	       (atomic_read(&spool_size) > 0) &&
-	       (!kfifo_is_full(&msg_fifo)))
-	{
-		loff_t pos = spool_pos;
+	off = q->spool_pos;
 
-		if ((kernel_read(spool_f, pos, (void *)&siz, 2)) != 2) {
-			dev_err(devp, "%s: kernel_read (size)\n",
-				__func__);
+	if (q->spool_zlen) {
+		len = q->spool_zlen - q->spool_zpos;
+		if (kernel_write(f, q->spool_zbuf + q->spool_zpos, len, *pos) != len)
 			return -EIO;
-		}
 
-		m.size = siz;
-		m.buf = kmem_cache_alloc(msg_cache, GFP_KERNEL);
-
-		pos += 2;
+		*pos += len;
+		off += q->spool_zframe;
+	}
 
-		if ((kernel_read(spool_f, pos, m.buf, siz)) != siz) {
-			dev_err(devp, "%s: kernel_read (data) %u\n",
-				__func__, siz);
-			kmem_cache_free(msg_cache, m.buf);
+	while (off < end) {
+		ret = kernel_read(q->spool_head_f, off, buf,
+				  min_t(loff_t, SLKQ_SPOOL_RBUF_SIZE, end - off));
+		if (ret <= 0)
 			return -EIO;
-		}
 
-		pos += siz;
-
-		if (kfifo_put(&msg_fifo, m) != 1) {
-			kmem_cache_free(msg_cache, m.buf);
+		if (kernel_write(f, buf, ret, *pos) != ret)
 			return -EIO;
 
-		}
-
-		spool_pos = pos;;
-		atomic_dec(&spool_size);
-	}
-
-	/* "Cut" the beginning of file using FALLOCATE (if limit is reached) */
-	if (spool_pos > SLKQ_SPOOL_COLLAPSE_LIMIT) {
-		dev_dbg(devp, "%s: going to collapse\n", __func__);
-		if (vfs_fallocate(spool_f, FALLOC_FL_COLLAPSE_RANGE, 0,
-				  (spool_pos / SLKQ_DISK_BLK_SIZE) * SLKQ_DISK_BLK_SIZE)) {
-			dev_dbg(devp, "%s: vfs_fallocate() failed\n",
-				__func__);
-		} else {
-			spool_pos = spool_pos % SLKQ_DISK_BLK_SIZE;
-		}
+		off += ret;
+		*pos += ret;
 	}
 
 	return 0;
 }
 
 /**
- * slkq_dev_read -- pops queue element which is triggered by reading /dev/slkq
- *
- * Note that the ordering can't be guaranteed because first blocks of queue are
- * moved to on-disk storage when it's full, and it gets recovered only when enough
- * space available (as we try to minimize amount of I/O)
+ * slkq_spool_save -- writes spool out on module unload
  *
+ * Records in flight and staging buffer are written out (spool work is
+ * stopped by now), FIFO contents are saved to segment that precedes head
+ * one, so they come first on next load. Unconsumed records of head segment
+ * follow them there and head segment is truncated once checkpoint points
+ * to the new one, so records consumed already aren't delivered again.
  */
-static ssize_t slkq_dev_read (struct file *file, char __user *ubuf,
-			      size_t len, loff_t *off)
+static void slkq_spool_save (struct slkq_queue *q)
 {
-	ssize_t ret;
-	unsigned int copied;
 	struct slkq_fifo_msg m;
+	struct file *f;
+	loff_t pos = 0;
+	size_t used = 0;
+	bool saved = false;
+	u32 crc;
+	int ret;
 
-	ret = mutex_lock_interruptible(&out_fifo_lock);
-	if (ret)
-		return ret;
+	/* what's in flight goes first, staged messages follow */
+	ret = __spool_flush(q, true);
 
-	while (kfifo_is_empty(&msg_fifo)) {
-		mutex_unlock(&out_fifo_lock);
+	mutex_lock(&q->in_fifo_lock);
+	if (__stage_drain(q) < 0)
+		pr_err("%s: staged messages are lost\n", __func__);
+	mutex_unlock(&q->in_fifo_lock);
 
-		if (file->f_flags & O_NONBLOCK) {
-			return -EAGAIN;
-		}
+	if (ret || __spool_flush(q, true) || __spool_flush(q, true))
+		pr_err("%s: staging buffer is lost\n", __func__);
 
-		ret = wait_event_interruptible(msg_new_q,
-					       !kfifo_is_empty(&msg_fifo));
+	mutex_lock(&q->spool_load_lock);
+	mutex_lock(&q->in_fifo_lock);
 
-		if (ret) {
-			return ret;
-		}
+	if (kfifo_is_empty(&q->msg_fifo))
+		goto out;
 
-		ret = mutex_lock_interruptible(&out_fifo_lock);
-		if (ret) {
-			return ret;
-		}
+	f = __spool_seg_open(q, q->spool_head_seq - 1, O_CREAT | O_TRUNC);
+	if (IS_ERR(f)) {
+		pr_err("%s: FIFO contents are lost\n", __func__);
+
+		while (kfifo_get(&q->msg_fifo, &m))
+			slkq_msg_free(&m);
+		goto out;
 	}
 
-	/* Just peeking at this point because message size can be larger than
-	 * user provided buffer so syscall is going to fail
-	 */
-	ret = kfifo_peek(&msg_fifo, &m);
+	while (kfifo_get(&q->msg_fifo, &m)) {
+		if (used + SLKQ_SPOOL_REC_HDR_SIZE + m.size > SLKQ_SPOOL_WBUF_SIZE) {
+			if (kernel_write(f, q->spool_wbuf, used, pos) != used)
+				break;
+			pos += used;
+			used = 0;
+		}
 
-	if (ret != 1) {
-		dev_err(devp, "kfifo_peek failed\n");
-		goto unlock;
-	}
+		crc = crc32c(~0, m.buf, m.size);
+		memcpy(q->spool_wbuf + used, &m.size, sizeof(m.size));
+		memcpy(q->spool_wbuf + used + sizeof(m.size), &crc, sizeof(crc));
+		memcpy(q->spool_wbuf + used + SLKQ_SPOOL_REC_HDR_SIZE, m.buf, m.size);
+		used += SLKQ_SPOOL_REC_HDR_SIZE + m.size;
 
-	if (m.size > len) {
-		dev_err(devp, "buffer is too small (%u > %lu)\n", m.size, len);
-		ret = -EFAULT;
-		goto unlock;
+		slkq_msg_free(&m);
 	}
 
-	ret = copy_to_user(ubuf, m.buf, m.size);
+	ret = (!kfifo_is_empty(&q->msg_fifo) ||
+	       kernel_write(f, q->spool_wbuf, used, pos) != used) ? -EIO : 0;
+	pos += used;
 
-	if (WARN_ON(ret)) {
-		dev_err(devp, "copy_to_user failed\n");
-		ret = -EFAULT;
-		goto unlock;
+	if (ret || __spool_save_head(q, f, &pos)) {
+		pr_err("%s: failed to save FIFO contents\n", __func__);
+		__spool_seg_unlink(f);
+		filp_close(f, NULL);
+
+		while (kfifo_get(&q->msg_fifo, &m))
+			slkq_msg_free(&m);
+		goto out;
 	}
 
-	/* Safe to skip at this point */
-	kfifo_skip(&msg_fifo);
+	vfs_fsync(f, 1);
+	filp_close(f, NULL);
 
-	mutex_unlock(&out_fifo_lock);
+	q->spool_head_seq--;
+	q->spool_pos = 0;
+	q->spool_zlen = 0;
+	q->spool_zskip = 0;
+	saved = true;
+out:
+	ret = __spool_checkpoint(q, q->spool_head_seq, q->spool_pos,
+				 q->spool_zskip, true);
 
-	if (SLKQ_FIFO_EXTEND_COND()) {
-		wake_up_interruptible(&msg_spool_q);
-	}
+	/* old head's records are in the new one checkpoint points to now */
+	if (saved && !ret && vfs_truncate(&q->spool_head_f->f_path, 0))
+		pr_err("%s: records of segment %llu are duplicated\n",
+		       __func__, q->spool_head_seq + 1);
 
-	return (m.size);
-unlock:
-	mutex_unlock(&out_fifo_lock);
-	return (ret) ? (ret) : (copied);
+	/* even with 'none' policy nothing is left unsynced on unload */
+	vfs_fsync(q->spool_tail_f, 1);
+	vfs_fsync(q->spool_ckpt_f, 1);
+
+	mutex_unlock(&q->in_fifo_lock);
+	mutex_unlock(&q->spool_load_lock);
+}
+
+static void slkq_spool_close (struct slkq_queue *q)
+{
+	if (q->spool_tail_f != q->spool_head_f)
+		filp_close(q->spool_tail_f, NULL);
+	filp_close(q->spool_head_f, NULL);
+	filp_close(q->spool_ckpt_f, NULL);
 }
 
 /**
- * slkq_dev_write -- push element to queue element which is trigerred by
- * writing to /dev/slkq
- *
- * Note that the ordering can't be guaranteed because first blocks of queue are
- * moved to on-disk storage when it's full, and it gets recovered only when enough
- * space available (as we try to minimize amount of I/O)
+ * slkq_queue_name_valid -- name becomes part of device, proc and spool file
+ * names, so it's restricted to [A-Za-z0-9_-]. '.' separates spool prefix
+ * from partition and segment suffixes, so e.g. "foo.p1" would share spool
+ * with partition 1 of "foo".
  */
-static ssize_t slkq_dev_write (struct file *file, const char __user *ubuf,
-			       size_t len, loff_t *off)
+static bool slkq_queue_name_valid (const char *name)
 {
-	ssize_t ret;
-	struct slkq_fifo_msg m;
+	size_t i, len = strnlen(name, SLKQ_QUEUE_NAME_MAX);
 
-	if (len > SLKQ_MSG_MAX_SIZE) {
-		dev_err(devp, "%s: wrong len = %lu\n", __func__, len);
-		return -EINVAL;
-	}
+	if (!len || len == SLKQ_QUEUE_NAME_MAX)
+		return false;
 
-	if (*off != 0) {
-		dev_err(devp, "%s: offset specified\n", __func__);
-		return -EINVAL;
+	for (i = 0; i < len; i++) {
+		if (!isalnum(name[i]) && !strchr("_-", name[i]))
+			return false;
 	}
 
+	return true;
+}
 
-	ret = mutex_trylock(&in_fifo_lock);
-	if ((ret == 0) && (file->f_flags & O_NONBLOCK)) {
-		return -EAGAIN;
-	} else if (ret == 0) {
-		ret = mutex_lock_interruptible(&in_fifo_lock);
-	}
+/* slkq_queue_find -- looks queue up by name, slkq_queues_lock is down */
+static struct slkq_queue *slkq_queue_find (const char *name)
+{
+	struct slkq_queue *q;
+	int id;
 
-	if (kfifo_is_full(&msg_fifo)) {
-		mutex_unlock(&in_fifo_lock);
-		wake_up_interruptible(&msg_spool_q);
+	idr_for_each_entry(&slkq_queues, q, id) {
+		if (!strcmp(q->name, name))
+			return q;
+	}
 
-		dev_err(devp, "%s: FATAL queue_full, this shouldn't happen\n",
-			__func__);
+	return NULL;
+}
 
-		return -1;
-	}
+/**
+ * __slkq_queue_init -- sets up FIFO, spool and spool work of queue or
+ * partition 'q' (names are set by caller)
+ */
+static int __slkq_queue_init (struct slkq_queue *q)
+{
+	int ret;
 
-	m.buf = kmem_cache_alloc(msg_cache, GFP_KERNEL);
-	if (!m.buf) {
-		dev_err(devp, "kmem_cache_alloc failed\n");
-		goto err1;
-	}
+	q->stats = alloc_percpu(struct slkq_stats);
+	if (!q->stats)
+		return -ENOMEM;
 
-	ret = copy_from_user(m.buf, ubuf, len);
+	ret = kfifo_alloc(&q->msg_fifo, fifo_length, GFP_KERNEL);
 	if (ret) {
-		dev_err(devp, "user => kernel failed\n");
-		goto err;
+		pr_err("%s: failed to allocate FIFO (ret = %d)\n", __func__, ret);
+		free_percpu(q->stats);
+		return ret;
 	}
 
-	m.size = len;
+	fifo_length = kfifo_size(&q->msg_fifo);
+
+	init_waitqueue_head(&q->msg_new_q);
+	init_waitqueue_head(&q->msg_space_q);
+
+	mutex_init(&q->in_fifo_lock);
+	mutex_init(&q->out_fifo_lock);
+	mutex_init(&q->spool_ckpt_lock);
+	mutex_init(&q->spool_load_lock);
+
+	INIT_DELAYED_WORK(&q->spool_load_work, slkq_spool_load_work);
+	INIT_DELAYED_WORK(&q->spool_flush_work, slkq_spool_flush_work);
+	INIT_DELAYED_WORK(&q->spool_sync_work, slkq_spool_sync_work);
+
+	atomic_set(&q->spool_size, 0);
+
+	if ((ret = slkq_spool_bufs_create(q))) {
+		pr_err("%s: failed to allocate spool buffers\n", __func__);
+		goto err0;
+	}
 
-	ret = kfifo_put(&msg_fifo, m);
-	if (ret != 1) {
-		dev_err(devp, "kfifo_put returned %zd\n", ret);
-		goto err;
+	if ((ret = slkq_stage_create(q))) {
+		pr_err("%s: failed to allocate staging rings\n", __func__);
+		goto err1;
 	}
 
-	if (kfifo_is_full(&msg_fifo)) {
-		dev_dbg(devp, "%s: full, waking spool_thread\n", __func__);
-		wake_up_interruptible(&msg_spool_q);
+	if ((ret = slkq_spool_recover(q))) {
+		pr_err("%s: failed to open spool of '%s'\n", __func__, q->name);
+		goto err2;
 	}
 
-	wake_up_interruptible(&msg_new_q);
-	mutex_unlock(&in_fifo_lock);
-	return len;
+	/* recovered spool gets loaded, new checkpoint written */
+	mutex_lock(&q->in_fifo_lock);
+	slkq_spool_kick(q);
+	slkq_spool_sync_kick(q);
+	mutex_unlock(&q->in_fifo_lock);
 
-err:
-	kmem_cache_free(msg_cache, m.buf);
+	return 0;
+
+err2:
+	slkq_stage_destroy(q);
 err1:
-	mutex_unlock(&in_fifo_lock);
-	return -EFAULT;
+	slkq_spool_bufs_destroy(q);
+err0:
+	kfifo_free(&q->msg_fifo);
+	free_percpu(q->stats);
+	return ret;
 }
 
-static const struct file_operations slkq_dev_ops = {
-        .owner = THIS_MODULE,
-        .write = slkq_dev_write,
-        .read = slkq_dev_read,
-};
-
-/**
- * slkq_status_read -- return status string that is accessed by reading
- * /proc/slkq_status entry
- */
-static ssize_t slkq_status_read (struct file *file, char __user *ubuf,
-				 size_t count, loff_t *off)
+/* __slkq_queue_fini -- saves spool and tears down what __slkq_queue_init set up */
+static void __slkq_queue_fini (struct slkq_queue *q)
 {
-	char buf[128];
-	int len = 0;
+	/**
+	 * Work items requeue each other (and themselves), so flag goes first.
+	 * Work that checked it before it was set can still queue once: load
+	 * is cancelled again, as flush running while load got cancelled might
+	 * have queued it. Sync work doesn't queue others, it goes last.
+	 */
+	WRITE_ONCE(q->spool_stopping, true);
+	cancel_delayed_work_sync(&q->spool_load_work);
+	cancel_delayed_work_sync(&q->spool_flush_work);
+	cancel_delayed_work_sync(&q->spool_load_work);
+	cancel_delayed_work_sync(&q->spool_sync_work);
 
-	if (*off) {
-		return 0;
-	}
+	slkq_spool_save(q);
+	slkq_spool_close(q);
+	slkq_stage_destroy(q);
+	slkq_spool_bufs_destroy(q);
+	kfifo_free(&q->msg_fifo);
+	free_percpu(q->stats);
+}
 
-	len += sprintf(buf, "%u %u %u %d\n", kfifo_len(&msg_fifo), kfifo_avail(&msg_fifo),
-		       kfifo_size(&msg_fifo), atomic_read(&spool_size));
+/* __slkq_parts_destroy -- tears down partitions of 'q' but 0th (queue itself) */
+static void __slkq_parts_destroy (struct slkq_queue *q)
+{
+	unsigned int i;
 
-	if (copy_to_user(ubuf, buf, len)) {
-		return -EFAULT;
+	for (i = 1; i < q->nparts; i++) {
+		__slkq_queue_fini(q->parts[i]);
+		kfree(q->parts[i]);
 	}
 
-	*off = len;
-
-	return len;
+	kfree(q->parts);
 }
 
-static const struct file_operations slkq_status_ops = {
-	.owner = THIS_MODULE,
-	.read = slkq_status_read,
-};
-
 /**
- * slkq_spool_thread() handles in-kernel queue <=> spool interaction described above
+ * __slkq_parts_create -- sets up 'nparts' partitions of 'q', partition n > 0
+ * has spool <prefix>.p<n>.*
  */
-static int slkq_spool_thread (void *data)
+static int __slkq_parts_create (struct slkq_queue *q, unsigned int nparts)
 {
-	for (;;) {
-		ssize_t ret;
-
-		wait_event_interruptible(msg_spool_q, kthread_should_stop() ||
-					 kfifo_is_full(&msg_fifo) || SLKQ_FIFO_EXTEND_COND());
-
-		if (kthread_should_stop()) {
-			return 0;
-		}
+	struct slkq_queue *p;
+	unsigned int i;
+	int ret;
 
-		/* FIFO is full and part of it must be unloaded to disk */
-		if (kfifo_is_full(&msg_fifo)) {
-			dev_dbg(devp, "%s: going to unload\n", __func__);
+	q->parts = kcalloc(nparts, sizeof(*q->parts), GFP_KERNEL);
+	if (!q->parts)
+		return -ENOMEM;
 
-			ret = mutex_lock_interruptible(&out_fifo_lock);
-			if (ret)
-				continue;
+	q->parts[0] = q;
+	q->nparts = 1;
 
-			__unload_to_spool();
-			mutex_unlock(&out_fifo_lock);
-			continue;
+	for (i = 1; i < nparts; i++) {
+		p = kzalloc(sizeof(*p), GFP_KERNEL);
+		if (!p) {
+			ret = -ENOMEM;
+			goto err;
 		}
 
-		/* Check if there is enough room for more elements, and load
-		 * from spool if available */
-		if (SLKQ_FIFO_EXTEND_COND()) {
-			dev_dbg(devp, "%s: going to load\n", __func__);
-
-			ret = mutex_lock_interruptible(&in_fifo_lock);
-			if (ret)
-				continue;
-
-			if (__load_from_spool() != 0) {
-				dev_err(devp, "%s: load_from_spool() failed\n",
-					__func__);
-				mutex_unlock(&in_fifo_lock);
-				BUG(); /* XXX: shouldn't happen */
-				return -1;
-			}
+		snprintf(p->name, sizeof(p->name), "%s.%u", q->name, i);
+		snprintf(p->prefix, sizeof(p->prefix), "%s.p%u", q->prefix, i);
+		p->minor = q->minor;
+		p->parent = q;
+		p->spool_compress = q->spool_compress;
 
-			mutex_unlock(&in_fifo_lock);
-			continue;
+		ret = __slkq_queue_init(p);
+		if (ret) {
+			kfree(p);
+			goto err;
 		}
 
-		BUG();
-        }
+		q->parts[q->nparts++] = p;
+	}
 
 	return 0;
+err:
+	__slkq_parts_destroy(q);
+	return ret;
 }
 
-static int slkq_init (void)
+/**
+ * __slkq_queue_create -- sets up queue 'name' (with 'nparts' partitions and
+ * SLKQ_QUEUE_* 'flags') and its device and status entry, slkq_queues_lock
+ * is down
+ *
+ * Default queue (SLKQ_NAME) is minor 0 and uses names without suffix.
+ */
+static int __slkq_queue_create (const char *name, unsigned int nparts,
+				unsigned int flags)
 {
+	struct slkq_queue *q;
+	unsigned int i;
 	int ret;
 
-	INIT_KFIFO(msg_fifo);
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return -ENOMEM;
 
-        init_waitqueue_head(&msg_new_q);
-        init_waitqueue_head(&msg_spool_q);
+	strlcpy(q->name, name, sizeof(q->name));
+	q->spool_compress = !!(flags & SLKQ_QUEUE_COMPRESS);
+	q->full_policy = full_policy;
 
-	mutex_init(&in_fifo_lock);
-	mutex_init(&out_fifo_lock);
+	if (!strcmp(name, SLKQ_NAME)) {
+		strlcpy(q->prefix, SLKQ_SPOOL_PREFIX, sizeof(q->prefix));
+		strlcpy(q->status_name, SLKQ_PROC_STATUS_FILENAME,
+			sizeof(q->status_name));
+	} else {
+		snprintf(q->prefix, sizeof(q->prefix), "%s-%s",
+			 SLKQ_SPOOL_PREFIX, name);
+		snprintf(q->status_name, sizeof(q->status_name), "%s-%s",
+			 SLKQ_PROC_STATUS_FILENAME, name);
+	}
 
-	if ((ret = alloc_chrdev_region(&dev, 0, 1, SLKQ_NAME)) < 0) {
-		pr_err("%s: failed to alloc dev region (ret = %d)", __func__,
-		       ret);
+	q->parent = q;
+	mutex_init(&q->group_lock);
+	INIT_LIST_HEAD(&q->members);
+
+	ret = idr_alloc(&slkq_queues, q, 0, SLKQ_QUEUES_MAX, GFP_KERNEL);
+	if (ret < 0) {
+		pr_err("%s: no free minor (ret = %d)\n", __func__, ret);
 		goto err0;
 	}
 
-	cdev_init(&chr_dev, &slkq_dev_ops);
+	q->minor = ret;
 
-	if ((ret = cdev_add(&chr_dev, dev, 1))) {
-		pr_err("%s: failed to add device (ret = %d)\n", __func__, ret);
+	if ((ret = __slkq_queue_init(q)))
 		goto err1;
-	}
-
-	dev_cls = class_create(THIS_MODULE, SLKQ_NAME);
 
-	if (dev_cls == NULL) {
-		pr_err("%s: failed to register device class\n", __func__);
+	if ((ret = __slkq_parts_create(q, nparts))) {
+		pr_err("%s: failed to create partitions of '%s'\n", __func__,
+		       name);
 		goto err2;
 	}
 
-	devp = device_create(dev_cls, NULL, dev, NULL, SLKQ_NAME);
+	q->status_ent = proc_create_data(q->status_name, 0, NULL,
+					 &slkq_status_ops, q);
 
-	if (IS_ERR(devp)) {
-		pr_err("%s: failed to create device\n", __func__);
+	if (!q->status_ent) {
+		pr_err("%s: failed to create proc file\n", __func__);
+		ret = -ENOMEM;
 		goto err3;
 	}
 
-	spool_f = filp_open(SLKQ_SPOOL_FILENAME, O_RDWR | O_TRUNC | O_CREAT | O_SYNC, 0);
+	q->cdev = cdev_alloc();
 
-	if (IS_ERR(spool_f)) {
-		pr_err("%s: failed to open spool file\n", __func__);
+	if (!q->cdev) {
+		ret = -ENOMEM;
 		goto err4;
 	}
 
-	msg_cache = kmem_cache_create(SLKQ_NAME, SLKQ_MSG_MAX_SIZE, 0, 0, NULL);
+	q->cdev->owner = THIS_MODULE;
+	q->cdev->ops = &slkq_dev_ops;
 
-	if (!msg_cache) {
-		pr_err("%s: failed to create cache\n", __func__);
+	if ((ret = cdev_add(q->cdev, MKDEV(MAJOR(dev), q->minor), 1))) {
+		pr_err("%s: failed to add device (ret = %d)\n", __func__, ret);
+		kobject_put(&q->cdev->kobj);
+		goto err4;
+	}
+
+	if (q->minor == 0)
+		q->devp = device_create(dev_cls, NULL, MKDEV(MAJOR(dev), 0),
+					NULL, SLKQ_NAME);
+	else
+		q->devp = device_create(dev_cls, NULL,
+					MKDEV(MAJOR(dev), q->minor), NULL,
+					"%s-%s", SLKQ_NAME, name);
+
+	if (IS_ERR(q->devp)) {
+		pr_err("%s: failed to create device\n", __func__);
+		ret = PTR_ERR(q->devp);
 		goto err5;
 	}
 
-	spool_thr = kthread_run(slkq_spool_thread, NULL, "slkq_spool_thr");
+	for (i = 1; i < q->nparts; i++)
+		q->parts[i]->devp = q->devp;
+
+	/* statistics are optional, debugfs failures are ignored */
+	q->dbg_dir = debugfs_create_dir(name, slkq_dbg_root);
+	debugfs_create_file("stats", 0444, q->dbg_dir, q, &slkq_stats_ops);
+	debugfs_create_file("histograms", 0444, q->dbg_dir, q,
+			    &slkq_histograms_ops);
+
+	dev_dbg(q->devp, "started, %u partition(s)\n", q->nparts);
+
+	return 0;
+
+err5:
+	cdev_del(q->cdev);
+err4:
+	remove_proc_entry(q->status_name, NULL);
+err3:
+	__slkq_parts_destroy(q);
+err2:
+	__slkq_queue_fini(q);
+err1:
+	idr_remove(&slkq_queues, q->minor);
+err0:
+	kfree(q);
+	return ret;
+}
+
+/**
+ * __slkq_queue_destroy -- tears queue down saving its spool (see
+ * slkq_spool_save), slkq_queues_lock is down and queue isn't open
+ */
+static void __slkq_queue_destroy (struct slkq_queue *q)
+{
+	debugfs_remove_recursive(q->dbg_dir);
+	device_destroy(dev_cls, MKDEV(MAJOR(dev), q->minor));
+	cdev_del(q->cdev);
+	remove_proc_entry(q->status_name, NULL);
+	__slkq_parts_destroy(q);
+	__slkq_queue_fini(q);
+	idr_remove(&slkq_queues, q->minor);
+	kfree(q);
+}
+
+static int slkq_queue_create (const char *name, unsigned int nparts,
+			      unsigned int flags)
+{
+	int ret;
+
+	if (!slkq_queue_name_valid(name) || !strcmp(name, SLKQ_NAME) ||
+	    nparts > SLKQ_PARTITIONS_MAX || (flags & ~SLKQ_QUEUE_COMPRESS))
+		return -EINVAL;
+
+	mutex_lock(&slkq_queues_lock);
+
+	if (slkq_queue_find(name))
+		ret = -EEXIST;
+	else
+		ret = __slkq_queue_create(name, (nparts) ? (nparts) : 1, flags);
+
+	mutex_unlock(&slkq_queues_lock);
+
+	return ret;
+}
+
+static int slkq_queue_destroy (const char *name)
+{
+	struct slkq_queue *q;
+	int ret = 0;
+
+	if (!slkq_queue_name_valid(name))
+		return -EINVAL;
+
+	mutex_lock(&slkq_queues_lock);
+
+	q = slkq_queue_find(name);
+
+	if (!q)
+		ret = -ENOENT;
+	else if (q->minor == 0)
+		ret = -EPERM;
+	else if (q->users)
+		ret = -EBUSY;
+	else
+		__slkq_queue_destroy(q);
+
+	mutex_unlock(&slkq_queues_lock);
+
+	return ret;
+}
+
+static int slkq_init (void)
+{
+	int ret;
+
+	if ((ret = alloc_chrdev_region(&dev, 0, SLKQ_QUEUES_MAX, SLKQ_NAME)) < 0) {
+		pr_err("%s: failed to alloc dev region (ret = %d)", __func__,
+		       ret);
+		return ret;
+	}
+
+	dev_cls = class_create(THIS_MODULE, SLKQ_NAME);
 
-	if (IS_ERR(spool_thr)) {
-		pr_err("%s: start of spool thread failed\n", __func__);
-		goto err6;
+	if (dev_cls == NULL) {
+		pr_err("%s: failed to register device class\n", __func__);
+		goto err0;
 	}
 
+	if (slkq_msg_caches_create()) {
+		pr_err("%s: failed to create cache\n", __func__);
+		goto err1;
+	}
 
-	status_ent = proc_create(SLKQ_PROC_STATUS_FILENAME, 0, NULL,
-				 &slkq_status_ops);
+	/* spool I/O of all queues, not bound to CPU of writer or reader */
+	slkq_spool_wq = alloc_workqueue("slkq_spool", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
 
-	if (!status_ent) {
-		pr_err("%s: failed to create proc file\n", __func__);
-		goto err7;
+	if (!slkq_spool_wq) {
+		pr_err("%s: failed to create workqueue\n", __func__);
+		goto err2;
 	}
 
-	dev_dbg(devp, "started\n");
+	if (spool_seg_size < SLKQ_SPOOL_SEG_SIZE_MIN)
+		spool_seg_size = SLKQ_SPOOL_SEG_SIZE_MIN;
+
+	slkq_dbg_root = debugfs_create_dir(SLKQ_NAME, NULL);
+
+	if (!partitions || partitions > SLKQ_PARTITIONS_MAX)
+		partitions = 1;
+
+	mutex_lock(&slkq_queues_lock);
+	ret = __slkq_queue_create(SLKQ_NAME, partitions,
+				  (spool_compress) ? (SLKQ_QUEUE_COMPRESS) : (0));
+	mutex_unlock(&slkq_queues_lock);
+
+	if (ret) {
+		pr_err("%s: failed to create default queue (ret = %d)\n",
+		       __func__, ret);
+		goto err3;
+	}
 
 	return 0;
 
-	remove_proc_entry(SLKQ_PROC_STATUS_FILENAME, NULL);
-err7:
-	kthread_stop(spool_thr);
-err6:
-	kmem_cache_destroy(msg_cache);
-err5:
-	filp_close(spool_f, NULL);
-err4:
-	device_destroy(dev_cls, dev);
 err3:
-	class_destroy(dev_cls);
+	destroy_workqueue(slkq_spool_wq);
 err2:
-	cdev_del(&chr_dev);
+	debugfs_remove_recursive(slkq_dbg_root);
+	slkq_msg_caches_destroy();
 err1:
-	unregister_chrdev_region(dev, 1);
+	class_destroy(dev_cls);
 err0:
-	kfifo_free(&msg_fifo);
+	unregister_chrdev_region(dev, SLKQ_QUEUES_MAX);
 	return -ENODEV;
 }
 
 static void slkq_exit (void)
 {
-	remove_proc_entry(SLKQ_PROC_STATUS_FILENAME, NULL);
-	kthread_stop(spool_thr);
-	kmem_cache_destroy(msg_cache);
-	filp_close(spool_f, NULL);
-	device_destroy(dev_cls, dev);
-	cdev_del(&chr_dev);
-	unregister_chrdev_region(dev, 1);
+	struct slkq_queue *q;
+	int id;
+
+	/* module can't be unloaded while any of devices is open */
+	mutex_lock(&slkq_queues_lock);
+	idr_for_each_entry(&slkq_queues, q, id)
+		__slkq_queue_destroy(q);
+	mutex_unlock(&slkq_queues_lock);
+
+	idr_destroy(&slkq_queues);
+	destroy_workqueue(slkq_spool_wq);
+	debugfs_remove_recursive(slkq_dbg_root);
+	slkq_msg_caches_destroy();
 	class_destroy(dev_cls);
-	kfifo_free(&msg_fifo);
+	unregister_chrdev_region(dev, SLKQ_QUEUES_MAX);
 
         return;
 }
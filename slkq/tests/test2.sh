@@ -1,7 +1,7 @@
 #!/bin/bash
 
-# Compile-time SLKQ_SPOOL_COLLAPSE_LIMIT must be set accordingly
-# for collapse part of code to be executed
+# Load with small 'spool_seg_size' (e.g. 131072) for segment rotation part
+# of code to be executed
 
 SCRIPT=$(readlink -f "$0")
 CPATH=$(dirname "$SCRIPT")
@@ -45,13 +45,13 @@ cat $CPATH/test2_2.out
 echo "Stats afterwards:"
 cat /proc/slkq_status
 
-echo "Going to empty (for collapse)"
+echo "Going to empty (for segment removal)"
 
-ls -l /var/spool/slkq.dat
+ls -l /var/spool/slkq.*.dat
 
 # cat /proc/slkq_status
 
-cat /dev/slkq > $CPATH/test2_collapse.out  &
+cat /dev/slkq > $CPATH/test2_drain.out  &
 CAT_PID=$!
 
 while true
@@ -0,0 +1,479 @@
+/*
+ * slkq_bench: simple user-space benchmark of /dev/slkq (SLKQ) push/pop
+ *             interfaces
+ *
+ * Copyright (C) 2019 Alexey Mikhailov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "../common/slkq.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/**
+ * slkq_bench pushes 'count' messages of 'size' bytes from 'writers' threads
+ * ('-w' option, 1 by default) and pops them from 'readers' threads ('-r'
+ * option, 1 by default), then reports throughput. Several readers join
+ * consumer group (see SLKQ_IOC_GROUP_JOIN), '-k' makes each writer route
+ * its messages by key (its number) instead of round robin, which matters
+ * for partitioned queues only. Interface is chosen
+ * by '-m' option:
+ *
+ *  - rw: one message per read()/write() (default mode of device)
+ *  - batch: SLKQ_MODE_BATCH, BATCH_BUF_SIZE bytes of records per syscall
+ *  - ring: shared memory rings, SLKQ_IOC_RING_PUSH/POP per ring-full
+ *  - ringpoll: shared memory rings driven by kernel (SLKQ_RING_POLL_*),
+ *    ioctl() only when kernel asks for it (SLKQ_RING_NEED_WAKEUP)
+ *
+ * '-q' option runs against named queue (/dev/slkq-<name>) instead of default
+ * one, so that several benchmarks can run over independent queues at once.
+ *
+ * E.g. ./slkq_bench -m ring -n 1000000 -s 64
+ *      ./slkq_bench -m rw -n 1000000 -s 64 -w 8
+ *      ./slkq_bench -q orders -m batch -n 1000000 -s 64 -w 8 -r 8 -k
+ *
+ * Queue should be empty before run, messages are counted (not compared).
+ */
+
+#define BATCH_BUF_SIZE (256 * 1024)
+#define RING_SLOTS 1024
+#define WRITERS_MAX 256
+
+static unsigned long writer_quota[WRITERS_MAX];
+
+enum { MODE_RW, MODE_BATCH, MODE_RING, MODE_RING_POLL };
+
+static int mode = MODE_RW;
+static unsigned long count = 100000;
+static unsigned int size = 64;
+static unsigned int writers = 1;
+static unsigned int readers = 1;
+static int keyed;
+static char dev_path[64] = SLKQ_DEV;
+
+static void usage (const char *bin) {
+        fprintf(stderr, "Usage: %s [-m rw|batch|ring|ringpoll] [-n count] [-s size] "
+                "[-w writers] [-r readers] [-k] [-q queue]\n",
+                bin);
+        exit(EXIT_FAILURE);
+}
+
+static int open_dev (int flags)
+{
+        int fd, m = SLKQ_MODE_BATCH;
+
+        fd = open(dev_path, flags);
+        if (fd < 0) {
+                fprintf(stderr, "failed to open %s: %s\n", dev_path,
+                        strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (mode == MODE_BATCH && ioctl(fd, SLKQ_IOC_SET_MODE, &m) < 0) {
+                fprintf(stderr, "SLKQ_IOC_SET_MODE: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        return fd;
+}
+
+/* ring_map -- sets up and maps shared memory rings of 'fd' */
+static unsigned char *ring_map (int fd, struct slkq_ring_params *p)
+{
+        unsigned char *mem;
+
+        memset(p, 0, sizeof(*p));
+        p->slots = RING_SLOTS;
+        p->slot_size = size + SLKQ_REC_HDR_SIZE;
+
+        if (mode == MODE_RING_POLL)
+                p->flags = SLKQ_RING_POLL_PUSH | SLKQ_RING_POLL_POP;
+
+        if (ioctl(fd, SLKQ_IOC_RING_SETUP, p) < 0) {
+                fprintf(stderr, "SLKQ_IOC_RING_SETUP: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        mem = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+                fprintf(stderr, "mmap: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        return mem;
+}
+
+/* push_failed -- write()/ioctl() result handling shared by producers */
+static int push_failed (int fd, long r)
+{
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+        if (r >= 0 || errno == EINTR)
+                return 0;
+
+        if (errno == EAGAIN) {
+                /* transient, retry once device is writable */
+                if (poll(&pfd, 1, -1) >= 0 || errno == EINTR)
+                        return 0;
+        }
+
+        fprintf(stderr, "push: %s\n", strerror(errno));
+        return 1;
+}
+
+/**
+ * ring_wakeup -- tells kernel about new slots of push ring (room made in pop
+ * ring): always in 'ring' mode, in 'ringpoll' mode only if kernel stopped
+ * polling the ring (see SLKQ_RING_NEED_WAKEUP)
+ */
+static long ring_wakeup (int fd, __u32 *flags, unsigned long cmd)
+{
+        if (mode == MODE_RING_POLL) {
+                /* index store is ordered before flags load */
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+                if (!(__atomic_load_n(flags, __ATOMIC_RELAXED) &
+                      SLKQ_RING_NEED_WAKEUP))
+                        return 0;
+        }
+
+        return ioctl(fd, cmd);
+}
+
+static void *producer (void *arg)
+{
+        char *buf;
+        unsigned long quota = *(unsigned long *)arg;
+        __u32 key = (unsigned long *)arg - writer_quota;
+        struct slkq_ring_params p;
+        struct slkq_ring_ctl *ctl;
+        unsigned char *mem;
+        unsigned long sent = 0;
+        unsigned int n, i;
+        size_t len, off;
+        __u32 tail;
+        ssize_t r;
+        int fd;
+
+        fd = open_dev(O_WRONLY);
+
+        if (keyed && ioctl(fd, SLKQ_IOC_SET_KEY, &key) < 0) {
+                fprintf(stderr, "SLKQ_IOC_SET_KEY: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        buf = malloc(BATCH_BUF_SIZE);
+        if (!buf) {
+                fprintf(stderr, "malloc failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        memset(buf, 'x', BATCH_BUF_SIZE);
+
+        switch (mode) {
+        case MODE_RW:
+                while (sent < quota) {
+                        r = write(fd, buf, size);
+                        if (push_failed(fd, r))
+                                break;
+                        if (r == (ssize_t)size)
+                                sent++;
+                }
+                break;
+        case MODE_BATCH:
+                n = BATCH_BUF_SIZE / (size + SLKQ_REC_HDR_SIZE);
+                for (i = 0; i < n; i++)
+                        *(__u16 *)(buf + i * (size + SLKQ_REC_HDR_SIZE)) = size;
+
+                while (sent < quota) {
+                        if (n > quota - sent)
+                                n = quota - sent;
+
+                        len = n * (size + SLKQ_REC_HDR_SIZE);
+                        off = 0;
+
+                        while (off < len) {
+                                r = write(fd, buf + off, len - off);
+                                if (push_failed(fd, r))
+                                        goto out;
+                                if (r > 0)
+                                        off += r;
+                        }
+
+                        sent += n;
+                }
+                break;
+        case MODE_RING:
+        case MODE_RING_POLL:
+                mem = ring_map(fd, &p);
+                ctl = (struct slkq_ring_ctl *)mem;
+                tail = 0;
+
+                while (sent < quota) {
+                        /* fill free slots, then ring the doorbell */
+                        while (tail - __atomic_load_n(&ctl->push_head,
+                                                      __ATOMIC_ACQUIRE) < p.slots
+                               && sent < quota) {
+                                unsigned char *slot = mem + p.push_off +
+                                        (tail & (p.slots - 1)) * p.slot_size;
+
+                                *(__u16 *)slot = size;
+                                memset(slot + SLKQ_REC_HDR_SIZE, 'x', size);
+                                tail++;
+                                sent++;
+                        }
+
+                        __atomic_store_n(&ctl->push_tail, tail,
+                                         __ATOMIC_RELEASE);
+
+                        if (push_failed(fd, ring_wakeup(fd, &ctl->push_flags,
+                                                        SLKQ_IOC_RING_PUSH)))
+                                break;
+                }
+
+                /* wait till kernel takes the rest */
+                while (__atomic_load_n(&ctl->push_head,
+                                       __ATOMIC_ACQUIRE) != tail) {
+                        if (push_failed(fd, ring_wakeup(fd, &ctl->push_flags,
+                                                        SLKQ_IOC_RING_PUSH)))
+                                break;
+                }
+                break;
+        }
+
+out:
+        free(buf);
+        close(fd);
+        return NULL;
+}
+
+/**
+ * pop_wait -- read()/ioctl() failure handling shared by consumers, returns
+ * non-zero if pop should be retried
+ */
+static int pop_wait (int fd)
+{
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (errno == EINTR)
+                return 1;
+
+        /* several consumers run non-blocking, so they see the end of run */
+        if (errno == EAGAIN)
+                return poll(&pfd, 1, 100) >= 0 || errno == EINTR;
+
+        return 0;
+}
+
+static void *consumer (void *arg)
+{
+        char *buf;
+        struct pollfd pfd = { .events = POLLIN };
+        struct slkq_ring_params p;
+        struct slkq_ring_ctl *ctl = NULL;
+        unsigned long *received = arg;
+        unsigned char *mem;
+        __u32 head = 0, tail;
+        unsigned long n;
+        size_t off;
+        ssize_t r = 0;
+        int fd;
+
+        fd = open_dev(O_RDONLY | ((readers > 1) ? O_NONBLOCK : 0));
+        pfd.fd = fd;
+
+        if (readers > 1 && ioctl(fd, SLKQ_IOC_GROUP_JOIN) < 0) {
+                fprintf(stderr, "SLKQ_IOC_GROUP_JOIN: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        buf = malloc(BATCH_BUF_SIZE);
+        if (!buf) {
+                fprintf(stderr, "malloc failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (mode == MODE_RING || mode == MODE_RING_POLL) {
+                mem = ring_map(fd, &p);
+                ctl = (struct slkq_ring_ctl *)mem;
+        }
+
+        while (__atomic_load_n(received, __ATOMIC_RELAXED) < count) {
+                switch (mode) {
+                case MODE_RW:
+                        r = read(fd, buf, SLKQ_MSG_MAX_SIZE);
+                        n = 1;
+                        break;
+                case MODE_BATCH:
+                        r = read(fd, buf, BATCH_BUF_SIZE);
+
+                        for (n = 0, off = 0; r > 0 && off < (size_t)r;
+                             off += SLKQ_REC_HDR_SIZE + *(__u16 *)(buf + off))
+                                n++;
+                        break;
+                case MODE_RING:
+                        r = ioctl(fd, SLKQ_IOC_RING_POP);
+
+                        tail = __atomic_load_n(&ctl->pop_tail,
+                                               __ATOMIC_ACQUIRE);
+
+                        /* payloads are consumed in place */
+                        n = tail - head;
+                        head = tail;
+
+                        __atomic_store_n(&ctl->pop_head, head,
+                                         __ATOMIC_RELEASE);
+                        break;
+                case MODE_RING_POLL:
+                        tail = __atomic_load_n(&ctl->pop_tail,
+                                               __ATOMIC_ACQUIRE);
+
+                        /* kernel fills pop ring, POLLIN once it's not empty */
+                        if (tail == head) {
+                                r = poll(&pfd, 1, 100);
+                                n = 0;
+                                break;
+                        }
+
+                        n = tail - head;
+                        head = tail;
+
+                        __atomic_store_n(&ctl->pop_head, head,
+                                         __ATOMIC_RELEASE);
+
+                        /* queue might be empty by now (other consumers) */
+                        r = ring_wakeup(fd, &ctl->pop_flags, SLKQ_IOC_RING_POP);
+                        if (r < 0 && (errno == EAGAIN || errno == EINTR))
+                                r = 0;
+                        break;
+                }
+
+                if (r < 0) {
+                        if (pop_wait(fd))
+                                continue;
+                        break;
+                }
+
+                __atomic_add_fetch(received, n, __ATOMIC_RELAXED);
+        }
+
+        if (r < 0)
+                fprintf(stderr, "pop: %s\n", strerror(errno));
+
+        free(buf);
+        close(fd);
+        return NULL;
+}
+
+int main (int argc, char **argv)
+{
+        pthread_t prod[WRITERS_MAX], cons[WRITERS_MAX];
+        struct timespec t0, t1;
+        unsigned long received = 0;
+        double secs;
+        unsigned int i;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "m:n:s:w:r:kq:")) != -1) {
+                switch (opt) {
+                case 'm':
+                        if (!strcmp(optarg, "rw"))
+                                mode = MODE_RW;
+                        else if (!strcmp(optarg, "batch"))
+                                mode = MODE_BATCH;
+                        else if (!strcmp(optarg, "ring"))
+                                mode = MODE_RING;
+                        else if (!strcmp(optarg, "ringpoll"))
+                                mode = MODE_RING_POLL;
+                        else
+                                usage(argv[0]);
+                        break;
+                case 'n':
+                        count = strtoul(optarg, NULL, 0);
+                        break;
+                case 's':
+                        size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'w':
+                        writers = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        readers = strtoul(optarg, NULL, 0);
+                        break;
+                case 'k':
+                        keyed = 1;
+                        break;
+                case 'q':
+                        snprintf(dev_path, sizeof(dev_path), "%s-%s",
+                                 SLKQ_DEV, optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (!count || !size || size >= SLKQ_MSG_MAX_SIZE ||
+            !writers || writers > WRITERS_MAX || writers > count ||
+            !readers || readers > WRITERS_MAX ||
+            size + SLKQ_REC_HDR_SIZE > BATCH_BUF_SIZE)
+                usage(argv[0]);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        for (i = 0; i < readers; i++) {
+                if (pthread_create(&cons[i], NULL, consumer, &received)) {
+                        fprintf(stderr, "pthread_create failed\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        /* messages are split evenly, first writer takes the remainder */
+        for (i = 0; i < writers; i++) {
+                writer_quota[i] = count / writers + (i ? 0 : count % writers);
+
+                if (pthread_create(&prod[i], NULL, producer, &writer_quota[i])) {
+                        fprintf(stderr, "pthread_create failed\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        for (i = 0; i < writers; i++)
+                pthread_join(prod[i], NULL);
+        for (i = 0; i < readers; i++)
+                pthread_join(cons[i], NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+        fprintf(stdout, "%lu msgs of %u bytes by %u writer(s), %u reader(s) "
+                "in %.3f s: %.0f msgs/s, %.1f MB/s\n",
+                received, size, writers, readers, secs, received / secs,
+                received * (double)size / secs / 1e6);
+
+        exit((received == count) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
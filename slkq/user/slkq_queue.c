@@ -0,0 +1,143 @@
+/*
+ * slkq_queue: simple user-space application that creates and destroys
+ *             named SLKQ queues and sets their full queue policy
+ *
+ * Copyright (C) 2019 Alexey Mikhailov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "../common/slkq.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+
+/**
+ * slkq_queue issues SLKQ_IOC_QUEUE_CREATE or SLKQ_IOC_QUEUE_DESTROY on
+ * /dev/slkq, or SLKQ_IOC_SET_FULL_POLICY on queue's device, e.g.
+ *
+ * ./slkq_queue create orders    (/dev/slkq-orders appears)
+ * ./slkq_queue create orders 8  (same, with 8 partitions)
+ * ./slkq_queue create orders 8 compress  (LZ4 compressed spool)
+ * ./slkq_queue policy orders block
+ * ./slkq_queue destroy orders
+ */
+
+static const char * const policies[] = {
+        [SLKQ_FULL_SPOOL] = "spool",
+        [SLKQ_FULL_BLOCK] = "block",
+        [SLKQ_FULL_DROP_OLDEST] = "drop_oldest",
+        [SLKQ_FULL_DROP_NEWEST] = "drop_newest",
+};
+
+static void usage (const char *bin) {
+        fprintf(stderr, "Usage: %s create name [partitions [compress]] | "
+                "destroy name |\n"
+                "       %s policy name spool|block|drop_oldest|drop_newest\n",
+                bin, bin);
+        exit(EXIT_FAILURE);
+}
+
+/* set_policy -- sets full queue policy of queue 'name' */
+static void set_policy (const char *bin, const char *name, const char *arg)
+{
+        int n = sizeof(policies) / sizeof(policies[0]);
+        char path[64];
+        int fd, policy;
+
+        for (policy = 0; policy < n; policy++) {
+                if (!strcmp(arg, policies[policy]))
+                        break;
+        }
+
+        if (policy == n)
+                usage(bin);
+
+        if (!strcmp(name, SLKQ_NAME))
+                snprintf(path, sizeof(path), "%s", SLKQ_DEV);
+        else
+                snprintf(path, sizeof(path), "%s-%s", SLKQ_DEV, name);
+
+        fd = open(path, O_RDONLY);
+
+        if (fd < 0) {
+                fprintf(stderr, "%s: failed to open %s: %s\n", bin, path,
+                        strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (ioctl(fd, SLKQ_IOC_SET_FULL_POLICY, &policy) < 0) {
+                fprintf(stderr, "%s: policy %s: %s\n", bin, name,
+                        strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        close(fd);
+        exit(EXIT_SUCCESS);
+}
+
+int main (int argc, char **argv)
+{
+        struct slkq_queue_params qp;
+        unsigned long cmd;
+        int fd;
+
+        if (argc < 3 || strlen(argv[2]) >= sizeof(qp.name))
+                usage(argv[0]);
+
+        memset(&qp, 0, sizeof(qp));
+        strcpy(qp.name, argv[2]);
+
+        if (!strcmp(argv[1], "create") && argc <= 5) {
+                cmd = SLKQ_IOC_QUEUE_CREATE;
+                if (argc >= 4)
+                        qp.partitions = strtoul(argv[3], NULL, 0);
+                if (argc == 5) {
+                        if (strcmp(argv[4], "compress"))
+                                usage(argv[0]);
+                        qp.flags |= SLKQ_QUEUE_COMPRESS;
+                }
+        } else if (!strcmp(argv[1], "destroy") && argc == 3) {
+                cmd = SLKQ_IOC_QUEUE_DESTROY;
+        } else if (!strcmp(argv[1], "policy") && argc == 4) {
+                set_policy(argv[0], argv[2], argv[3]);
+        } else {
+                usage(argv[0]);
+        }
+
+        fd = open(SLKQ_DEV, O_RDONLY);
+
+        if (fd < 0) {
+                fprintf(stderr, "%s: failed to open %s: %s\n",
+                        argv[0], SLKQ_DEV, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (ioctl(fd, cmd, &qp) < 0) {
+                fprintf(stderr, "%s: %s %s: %s\n", argv[0], argv[1],
+                        argv[2], strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        close(fd);
+
+        exit(EXIT_SUCCESS);
+}
@@ -19,6 +19,8 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#define _GNU_SOURCE /* splice() */
+
 #include "../common/slkq.h"
 #include "atomic_io.h"
 #include "log.h"
@@ -33,6 +35,7 @@
 #include <time.h>
 
 #include <linux/limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 
 /**
@@ -42,17 +45,31 @@
  * There is file rotation happens, it controlled by T_WIN and specified in
  * seconds (e.g. 5*60 (300) value means that rotation happens every 5
  * minutes).
+ *
+ * Device is switched to batch mode (SLKQ_IOC_SET_MODE), so single read()
+ * returns up to READ_BUF_SIZE bytes of records. Records already use the same
+ * format as output file, so buffer is written out as is. If module doesn't
+ * support batch mode, messages are read one by one.
+ *
+ * With -s records are spliced from device to pipe and from pipe to output
+ * file, so they aren't copied through user space (batch mode only).
  */
 
 #define T_WIN (5 * 60)
+#define READ_BUF_SIZE (1024 * 1024)
 
 static unsigned int is_daemon = 1;
 static unsigned int stopping = 0;
 static int slkq_fd = -1;
 static int out_fd = -1;
+static int is_batch = 0;
+static int is_splice = 0;
+static int pipe_fd[2] = { -1, -1 };
+static int pipe_size = 0;
+static char buf[READ_BUF_SIZE];
 
 static void usage (const char *bin) {
-        fprintf(stderr, "Usage: %s [-f]\n", bin);
+        fprintf(stderr, "Usage: %s [-f] [-s]\n", bin);
         exit(EXIT_FAILURE);
 }
 
@@ -122,8 +139,12 @@ static int open_new_export_file (const char *dir, struct tm *t)
                  (t->tm_year+1900), (t->tm_mon+1), t->tm_mday,
                  (t->tm_hour), (t->tm_min));
 
-        if ((fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0) {
+        /* splice() doesn't take O_APPEND files, there is single writer anyway */
+        if ((fd = open(fname, O_WRONLY | O_CREAT | (is_splice ? 0 : O_APPEND),
+                       0666)) < 0) {
                 syslog(LOG_ERR, "can't open export file %s: %m", fname);
+        } else if (is_splice) {
+                lseek(fd, 0, SEEK_END);
         }
 
         return fd;
@@ -167,16 +188,61 @@ static int already_running (void)
         return(0);
 }
 
+/* setup_splice -- creates pipe records are spliced through */
+static int setup_splice (void)
+{
+        if (pipe(pipe_fd) < 0)
+                return -1;
+
+        /* best effort, default is 64 KiB */
+        fcntl(pipe_fd[1], F_SETPIPE_SZ, READ_BUF_SIZE);
+
+        pipe_size = fcntl(pipe_fd[1], F_GETPIPE_SZ);
+        if (pipe_size <= 0) {
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
+                return -1;
+        }
+
+        return 0;
+}
+
+/* splice_out -- moves 'len' bytes from pipe to export file */
+static int splice_out (ssize_t len)
+{
+        ssize_t r;
+
+        while (len > 0) {
+                r = splice(pipe_fd[0], NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r <= 0) {
+                        logit(LOG_ERR, "%s: splice(): %m", __func__);
+                        return -1;
+                }
+
+                len -= r;
+        }
+
+        return 0;
+}
+
 static time_t t_start = 0, t_now = 0;
 
 /* handle_input -- handle input on 'slkq' device*/
 static int handle_input (int fd)
 {
-        char buf[SLKQ_MSG_MAX_SIZE];
         ssize_t r;
+        u_int16_t siz;
 
-        if ((r = read(fd, buf, sizeof(buf))) <= 0) {
-                logit(LOG_ERR, "%s: read(): %m", __func__);
+        if (is_splice)
+                r = splice(fd, NULL, pipe_fd[1], NULL, pipe_size, SPLICE_F_MOVE);
+        else
+                r = read(fd, buf, is_batch ? sizeof(buf) : SLKQ_MSG_MAX_SIZE);
+
+        if (r <= 0) {
+                logit(LOG_ERR, "%s: %s(): %m", __func__,
+                      is_splice ? "splice" : "read");
                 return r;
         }
 
@@ -200,8 +266,22 @@ static int handle_input (int fd)
         }
 
         /* Write buffer to file. Spool file uses variable record format where
-         * record's first two byes indicate the length of the record */
-        if (atomicio(vwrite, out_fd, (u_int16_t *)&r, 2) != 2) {
+         * record's first two byes indicate the length of the record. In batch
+         * mode buffer is already in this format */
+        if (is_splice)
+                return (splice_out(r) < 0) ? -1 : r;
+
+        if (is_batch) {
+                if (atomicio(vwrite, out_fd, buf, r) != r) {
+                        logit(LOG_ERR, "%s: write: %m", __func__);
+                        return -1;
+                }
+
+                return r;
+        }
+
+        siz = r;
+        if (atomicio(vwrite, out_fd, &siz, 2) != 2) {
                 logit(LOG_ERR, "%s: write: %m", __func__);
                 return -1;
         }
@@ -215,13 +295,16 @@ static int handle_input (int fd)
 
 int main (int argc, char **argv)
 {
-        int opt, rc = -1;
+        int opt, mode, rc = -1;
 
-        while ((opt = getopt(argc, argv, "f")) != -1) {
+        while ((opt = getopt(argc, argv, "fs")) != -1) {
                 switch (opt) {
                 case 'f':
                         is_daemon = 0;
                         break;
+                case 's':
+                        is_splice = 1;
+                        break;
                 default:
                         usage(argv[0]);
                 }
@@ -246,6 +329,19 @@ int main (int argc, char **argv)
                 exit(EXIT_FAILURE);
         }
 
+        mode = SLKQ_MODE_BATCH;
+        if (ioctl(slkq_fd, SLKQ_IOC_SET_MODE, &mode) == 0) {
+                is_batch = 1;
+        } else {
+                logit(LOG_INFO, "%s: batch mode not supported: %s",
+                      argv[0], strerror(errno));
+        }
+
+        if (is_splice && (!is_batch || setup_splice() < 0)) {
+                logit(LOG_INFO, "%s: splice isn't used", argv[0]);
+                is_splice = 0;
+        }
+
         do {
                 if (stopping) {
                         break;
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <sys/stat.h>
@@ -39,9 +40,8 @@
  *  - if none of above is speicified, message gets read from stdin
  *
  * '-a' option toggles nonblocking behavior for write operation.
- * If specified, O_NONBLOCK is going to be set on socket and application
- * will try to write to socket till it will receive anything but
- * EAGAIN.
+ * If specified, O_NONBLOCK is going to be set on device and application
+ * will wait for it to become writable (poll()) and retry on EAGAIN.
  */
 
 static unsigned int is_async = 0;
@@ -61,6 +61,7 @@ int main (int argc, char **argv)
         ssize_t r;
         unsigned int t;
         char *p;
+        struct pollfd pfd;
 
         while ((opt = getopt(argc, argv, "af:")) != -1) {
                 switch (opt) {
@@ -158,7 +159,15 @@ int main (int argc, char **argv)
                         break;
                 } else if (errno == EAGAIN && r == -1) {
                         fprintf(stdout, "EAGAIN\n");
-                        sleep(2);
+
+                        pfd.fd = slkq_fd;
+                        pfd.events = POLLOUT;
+
+                        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                                fprintf(stdout, "ERROR poll %s\n",
+                                        strerror(errno));
+                                break;
+                        }
                         continue;
                 } else {
                         fprintf(stdout, "ERROR %ld %s\n",
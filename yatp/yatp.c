@@ -10,8 +10,10 @@
  */
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -25,6 +27,275 @@
 
 #define YATP_PRIO_HIGH_THRESHOLD 3
 
+#if YATP_TRACE
+#define yatp_trace(tp, type, f, arg, prio)                              \
+        do {                                                            \
+                if (__builtin_expect(atomic_load_explicit(&(tp)->trace_on, \
+                                     memory_order_acquire), 0))         \
+                        yatp_trace_ev((tp), (type), (f), (arg), (prio)); \
+        } while (0)
+#else
+#define yatp_trace(tp, type, f, arg, prio) do { } while (0)
+#endif
+
+/*
+ * Process-wide registry of worker tokens. Once it's initialized (see
+ * yatp_registry_init), workers of pools created afterwards have to hold
+ * a token to run tasks, so total number of running workers across all of
+ * such pools doesn't exceed number of tokens (CPU cores by default).
+ * Worker gives its token up when it runs out of tasks, or after finishing
+ * task if workers of other pools are waiting for token.
+ */
+static struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t event;
+        unsigned int is_active;
+        unsigned int n_tokens;
+        int n_free;
+        atomic_uint n_waiting;
+} yatp_registry = {
+        PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_COND_INITIALIZER,
+};
+
+/* pool and index of the worker running in this thread (for tracing) */
+static __thread struct yatp_t *yatp_self_tp;
+static __thread unsigned int yatp_self_idx;
+
+static void yatp_now (struct timespec *ts)
+{
+        clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+#if YATP_TRACE
+static atomic_uint yatp_trace_tids;
+static __thread unsigned int yatp_trace_tid;
+
+/*
+ * yatp_trace_ev -- records event into ring of current worker (or into
+ * shared ring if thread isn't one of pool's workers). Lock-free: slot is
+ * reserved by bumping ring head, 'seq' is published last so dump can
+ * skip slots being overwritten.
+ */
+static void yatp_trace_ev (struct yatp_t *tp, enum yatp_trace_type_t type,
+                           void (*f)(void *), void *arg, enum yatp_prio_t prio)
+{
+        struct yatp_trace_ring_t *r;
+        struct yatp_trace_ev_t *e;
+        struct timespec ts;
+        unsigned long pos;
+
+        if (yatp_trace_tid == 0)
+                yatp_trace_tid = atomic_fetch_add(&yatp_trace_tids, 1) + 1;
+
+        if (yatp_self_tp == tp)
+                r = &tp->trace[yatp_self_idx];
+        else
+                r = &tp->trace[tp->n_workers];
+
+        yatp_now(&ts);
+
+        pos = atomic_fetch_add_explicit(&r->head, 1, memory_order_relaxed);
+        e = &r->ev[pos & r->mask];
+
+        atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        e->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        e->f = f;
+        e->arg = arg;
+        e->tid = yatp_trace_tid;
+        e->type = type;
+        e->prio = prio;
+        atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+}
+#endif
+
+static unsigned long long yatp_ts_ns (const struct timespec *start,
+                                      const struct timespec *end)
+{
+        return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+                end->tv_nsec - start->tv_nsec;
+}
+
+static double yatp_ts_diff (const struct timespec *a, const struct timespec *b)
+{
+        return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/*
+ * yatp_bucket_ready -- refills token bucket and checks if there is a token
+ * available. If there is none, 'next' is set to the moment next token
+ * appears (unless 'next' already points to earlier moment), so worker
+ * could sleep on q_event till then instead of spinning.
+ */
+static int yatp_bucket_ready (struct yatp_bucket_t *b,
+                              const struct timespec *now,
+                              struct timespec *next)
+{
+        double wait;
+        struct timespec t;
+
+        if (b->rate == 0)
+                return 1;
+
+        b->tokens += yatp_ts_diff(now, &b->last) * b->rate;
+        if (b->tokens > b->burst)
+                b->tokens = b->burst;
+        b->last = *now;
+
+        if (b->tokens >= 1.0)
+                return 1;
+
+        wait = (1.0 - b->tokens) / b->rate;
+        t.tv_sec = now->tv_sec + (time_t)wait;
+        t.tv_nsec = now->tv_nsec + (long)((wait - (time_t)wait) * 1e9) + 1;
+        if (t.tv_nsec >= 1000000000L) {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000L;
+        }
+
+        if ((next->tv_sec == 0 && next->tv_nsec == 0) ||
+            yatp_ts_diff(&t, next) < 0)
+                *next = t;
+
+        return 0;
+}
+
+/*
+ * Lock-free bounded MPMC ring (D. Vyukov's algorithm). Each slot carries
+ * sequence number telling whether it's free for producer at position
+ * 'pos' (seq == pos) or holds task for consumer (seq == pos + 1).
+ */
+static struct yatp_ring_t *yatp_ring_alloc (unsigned long size)
+{
+        struct yatp_ring_t *r;
+        unsigned long i;
+
+        r = aligned_alloc(YATP_CACHE_LINE, sizeof(struct yatp_ring_t));
+        if (r == NULL)
+                return NULL;
+
+        r->slots = aligned_alloc(YATP_CACHE_LINE,
+                                 size * sizeof(struct yatp_ring_slot_t));
+        if (r->slots == NULL) {
+                free(r);
+                return NULL;
+        }
+
+        for (i = 0; i < size; i++)
+                atomic_init(&r->slots[i].seq, i);
+
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        atomic_init(&r->in_row, 0);
+        atomic_init(&r->overflow, 0);
+        r->mask = size - 1;
+
+        return r;
+}
+
+static void yatp_ring_free (struct yatp_ring_t *r)
+{
+        free(r->slots);
+        free(r);
+}
+
+static int yatp_ring_push (struct yatp_ring_t *r, void (*f) (void *),
+                           void *arg)
+{
+        struct yatp_ring_slot_t *slot;
+        unsigned long pos, seq;
+        long diff;
+
+        pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+        for (;;) {
+                slot = &r->slots[pos & r->mask];
+                seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+                diff = (long)seq - (long)pos;
+
+                if (diff == 0) {
+                        if (atomic_compare_exchange_weak_explicit(
+                                    &r->head, &pos, pos + 1,
+                                    memory_order_relaxed,
+                                    memory_order_relaxed))
+                                break;
+                } else if (diff < 0) {
+                        /* full */
+                        return -1;
+                } else {
+                        pos = atomic_load_explicit(&r->head,
+                                                   memory_order_relaxed);
+                }
+        }
+
+        slot->f = f;
+        slot->arg = arg;
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+        return 0;
+}
+
+static int yatp_ring_pop (struct yatp_ring_t *r, void (**f) (void *),
+                          void **arg)
+{
+        struct yatp_ring_slot_t *slot;
+        unsigned long pos, seq;
+        long diff;
+
+        pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+        for (;;) {
+                slot = &r->slots[pos & r->mask];
+                seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+                diff = (long)seq - (long)(pos + 1);
+
+                if (diff == 0) {
+                        if (atomic_compare_exchange_weak_explicit(
+                                    &r->tail, &pos, pos + 1,
+                                    memory_order_relaxed,
+                                    memory_order_relaxed))
+                                break;
+                } else if (diff < 0) {
+                        /* empty */
+                        return -1;
+                } else {
+                        pos = atomic_load_explicit(&r->tail,
+                                                   memory_order_relaxed);
+                }
+        }
+
+        *f = slot->f;
+        *arg = slot->arg;
+        atomic_store_explicit(&slot->seq, pos + r->mask + 1,
+                              memory_order_release);
+
+        return 0;
+}
+
+static unsigned long yatp_ring_len (struct yatp_ring_t *r)
+{
+        long len = atomic_load_explicit(&r->head, memory_order_relaxed) -
+                atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+        return (len > 0) ? len : 0;
+}
+
+static unsigned long yatp_queue_len (struct yatp_queue_t *q)
+{
+        return q->size + (q->ring ? yatp_ring_len(q->ring) : 0);
+}
+
+static int yatp_queue_ready (struct yatp_queue_t *q,
+                             const struct timespec *now,
+                             struct timespec *next)
+{
+        if (yatp_queue_len(q) == 0)
+                return 0;
+
+        return yatp_bucket_ready(&q->bucket, now, next);
+}
+
 static struct yatp_task_t *yatp_get_task (struct yatp_queue_t *q)
 {
         struct yatp_task_t *t = q->first;
@@ -41,85 +312,571 @@ static struct yatp_task_t *yatp_get_task (struct yatp_queue_t *q)
         return t;
 }
 
-static struct yatp_task_t *yatp_dequeue (struct yatp_t *tp)
+/*
+ * yatp_group_pick -- picks group's queue to take next task from according
+ * to priority policy. Queues with empty token bucket are skipped, in this
+ * case 'next' is set to the moment when throttled queue is going to become
+ * ready. If 'peek' is set, policy state isn't updated.
+ */
+static struct yatp_queue_t *yatp_group_pick (struct yatp_group_t *g,
+                                             const struct timespec *now,
+                                             struct timespec *next,
+                                             int peek)
 {
-        struct yatp_queue_t *hq = tp->queue[YATP_PRIO_HIGH];
-        struct yatp_queue_t *nq = tp->queue[YATP_PRIO_NORMAL];
-        struct yatp_queue_t *lq = tp->queue[YATP_PRIO_LOW];
+        struct yatp_queue_t *hq = g->queue[YATP_PRIO_HIGH];
+        struct yatp_queue_t *nq = g->queue[YATP_PRIO_NORMAL];
+        struct yatp_queue_t *lq = g->queue[YATP_PRIO_LOW];
+        int hr, nr, lr;
+
+        hr = yatp_queue_ready(hq, now, next);
+        nr = yatp_queue_ready(nq, now, next);
+        lr = yatp_queue_ready(lq, now, next);
 
-        if (hq->size) {
-                if ((hq->in_row >= YATP_PRIO_HIGH_THRESHOLD) && nq->size) {
+        if (hr) {
+                if ((hq->in_row >= YATP_PRIO_HIGH_THRESHOLD) && nr) {
                         /* going to run normal prio'd task because of policy */
-                        hq->in_row = 0;
-                } else {
+                        if (!peek)
+                                hq->in_row = 0;
+                        return nq;
+                }
+
+                if (!peek)
                         hq->in_row++;
-                        return yatp_get_task(hq);
+                return hq;
+        }
+
+        if (nr)
+                return nq;
+
+        if (lr)
+                return lq;
+
+        /* no tasks */
+        return NULL;
+}
+
+/*
+ * yatp_queue_take -- takes task from the queue into 't', ring (if any) goes
+ * first as it holds older tasks than overflow list. Returns -1 if queue is
+ * empty.
+ *
+ * Must be called with q_mutex held.
+ */
+static int yatp_queue_take (struct yatp_group_t *g, struct yatp_queue_t *q,
+                            struct yatp_task_t *t)
+{
+        struct yatp_task_t *lt;
+
+        if (q->ring != NULL && yatp_ring_pop(q->ring, &t->f, &t->arg) == 0) {
+                t->prio = q->prio;
+                t->group = g;
+                t->next = NULL;
+        } else if (q->size) {
+                g->n_queued--;
+                g->tp->n_queued--;
+                lt = yatp_get_task(q);
+                *t = *lt;
+                free(lt);
+
+                if (q->ring)
+                        atomic_fetch_sub(&q->ring->overflow, 1);
+        } else {
+                return -1;
+        }
+
+        if (q->bucket.rate)
+                q->bucket.tokens -= 1.0;
+
+        return 0;
+}
+
+static int yatp_group_idle (struct yatp_group_t *g)
+{
+        int i;
+
+        if (g->n_queued)
+                return 0;
+
+        for (i = 0; i < YATP_PRIO_LAST; i++) {
+                if (g->queue[i]->ring && yatp_ring_len(g->queue[i]->ring))
+                        return 0;
+        }
+
+        return 1;
+}
+
+/*
+ * yatp_select -- picks group with ready tasks and smallest virtual runtime
+ * (CFS-like). 'next' is set to the moment when some throttled queue is
+ * going to become ready (zero if there is none).
+ */
+static struct yatp_group_t *yatp_select (struct yatp_t *tp,
+                                         struct timespec *now,
+                                         struct timespec *next)
+{
+        struct yatp_group_t *g, *best = NULL;
+
+        next->tv_sec = 0;
+        next->tv_nsec = 0;
+
+        if (tp->n_limited)
+                yatp_now(now);
+
+        for (g = tp->groups; g != NULL; g = g->next) {
+                if (yatp_group_idle(g))
+                        continue;
+
+                if (best && best->vruntime <= g->vruntime)
+                        continue;
+
+                if (yatp_group_pick(g, now, next, 1) != NULL)
+                        best = g;
+        }
+
+        return best;
+}
+
+/* yatp_pending -- checks if there is task ready to be taken */
+static int yatp_pending (struct yatp_t *tp, struct timespec *next)
+{
+        struct timespec now = { 0, 0 };
+
+        return yatp_select(tp, &now, next) != NULL;
+}
+
+/*
+ * yatp_dequeue -- takes next task of the group selected by yatp_select into
+ * 't'. 'next' is set as described there. Returns -1 if there is none.
+ */
+static int yatp_dequeue (struct yatp_t *tp, struct timespec *next,
+                         struct yatp_task_t *t)
+{
+        struct yatp_group_t *best;
+        struct yatp_queue_t *q;
+        struct timespec now = { 0, 0 };
+
+        best = yatp_select(tp, &now, next);
+
+        if (best == NULL)
+                return -1;
+
+        if (best->vruntime > tp->min_vruntime)
+                tp->min_vruntime = best->vruntime;
+
+        /* ring might be emptied by lock-free consumer in the meantime */
+        q = yatp_group_pick(best, &now, next, 0);
+        if (q == NULL || yatp_queue_take(best, q, t))
+                return -1;
+
+        best->n_running++;
+        yatp_trace(tp, YATP_TRACE_DEQUEUE, t->f, t->arg, t->prio);
+
+        return 0;
+}
+
+/*
+ * yatp_ring_dequeue -- lock-free counterpart of yatp_dequeue for root
+ * group's rings, used while there is nothing that needs q_mutex
+ * (see yatp_ring_update). Returns -1 if slow path must be taken.
+ */
+static int yatp_ring_dequeue (struct yatp_t *tp, struct yatp_task_t *t)
+{
+        struct yatp_ring_t *hr = tp->root->queue[YATP_PRIO_HIGH]->ring;
+        int i;
+
+        if (atomic_load_explicit(&hr->in_row, memory_order_relaxed) >=
+            YATP_PRIO_HIGH_THRESHOLD) {
+                /* going to run normal prio'd task because of policy */
+                atomic_store_explicit(&hr->in_row, 0, memory_order_relaxed);
+
+                if (yatp_ring_pop(tp->root->queue[YATP_PRIO_NORMAL]->ring,
+                                  &t->f, &t->arg) == 0) {
+                        t->prio = YATP_PRIO_NORMAL;
+                        goto found;
+                }
+        }
+
+        for (i = 0; i < YATP_PRIO_LAST; i++) {
+                struct yatp_ring_t *r = tp->root->queue[i]->ring;
+
+                if (yatp_ring_pop(r, &t->f, &t->arg) == 0) {
+                        if (i == YATP_PRIO_HIGH)
+                                atomic_fetch_add_explicit(&hr->in_row, 1,
+                                                          memory_order_relaxed);
+                        t->prio = i;
+                        goto found;
                 }
 
+                /* keeping FIFO order with tasks in overflow list */
+                if (atomic_load_explicit(&r->overflow, memory_order_relaxed))
+                        return -1;
         }
 
-        if (nq->size) {
-                return yatp_get_task(nq);
+        return -1;
+
+found:
+        t->group = tp->root;
+        yatp_trace(tp, YATP_TRACE_DEQUEUE, t->f, t->arg, t->prio);
+
+        return 0;
+}
+
+/*
+ * yatp_ring_update -- enables lock-free dispatching when pool has rings
+ * and only root group without rate limits
+ *
+ * Must be called with q_mutex held.
+ */
+static void yatp_ring_update (struct yatp_t *tp)
+{
+        atomic_store(&tp->ring_fast, tp->root->queue[0]->ring != NULL &&
+                     tp->groups->next == NULL && tp->n_limited == 0);
+}
+
+/*
+ * yatp_idle_wait -- waits on 'cond' for new tasks (or till 'next', if set).
+ * We get into n_idle before looking at rings for the last time: lock-free
+ * push that isn't seen there (even if its slot is still being filled) sees
+ * us in n_idle and signals, ones seen make us return immediately.
+ *
+ * Must be called with q_mutex held.
+ */
+static void yatp_idle_wait (struct yatp_t *tp, pthread_cond_t *cond,
+                            struct timespec *next)
+{
+        atomic_fetch_add(&tp->n_idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (!yatp_pending(tp, next)) {
+                if (next->tv_sec || next->tv_nsec)
+                        pthread_cond_timedwait(cond, &tp->q_mutex, next);
+                else
+                        pthread_cond_wait(cond, &tp->q_mutex);
         }
 
-        if (lq->size) {
-                return yatp_get_task(lq);
+        atomic_fetch_sub(&tp->n_idle, 1);
+}
+
+static void yatp_group_free (struct yatp_group_t *g)
+{
+        struct yatp_task_t *task;
+        int i;
+
+        for (i = 0; i < YATP_PRIO_LAST; i++) {
+                if (g->queue[i] == NULL)
+                        continue;
+
+                if (g->queue[i]->ring)
+                        yatp_ring_free(g->queue[i]->ring);
+
+                /* bypassing buckets, just dropping what's left */
+                while (g->queue[i]->size) {
+                        task = yatp_get_task(g->queue[i]);
+                        free(task);
+                }
+
+                free(g->queue[i]);
         }
 
-        /* no tasks */
-        return NULL;
+        free(g);
+}
+
+/*
+ * yatp_group_account -- accounts worker time spent on group's tasks
+ * ('n_done' of them)
+ *
+ * Must be called with q_mutex held.
+ */
+static void yatp_group_account (struct yatp_group_t *g,
+                                unsigned long long delta, unsigned long n_done)
+{
+        g->usage += delta;
+        g->vruntime += delta * YATP_GROUP_SHARE_DEFAULT / g->share;
+        g->n_done += n_done;
+}
+
+/*
+ * yatp_group_charge -- accounts group's task that completed: drops it from
+ * n_running, frees dying group once its last task is done and wakes
+ * helpers, as completion might be what they wait for
+ *
+ * Must be called with q_mutex held.
+ */
+static void yatp_group_charge (struct yatp_group_t *g,
+                               unsigned long long delta)
+{
+        struct yatp_t *tp = g->tp;
+
+        yatp_group_account(g, delta, 1);
+        g->n_running--;
+
+        if (g->is_dying && g->n_running == 0)
+                yatp_group_free(g);
+
+        /* completion might be what helpers are waiting for */
+        if (tp->n_helpers)
+                pthread_cond_broadcast(&(tp->h_event));
+}
+
+/*
+ * yatp_token_get -- blocks till worker token is available (or pool is
+ * stopping). Returns non-zero if token was taken.
+ */
+static int yatp_token_get (struct yatp_t *tp)
+{
+        int ret = 0;
+
+        pthread_mutex_lock(&yatp_registry.mutex);
+        yatp_registry.n_waiting++;
+
+        while (yatp_registry.n_free <= 0 && !tp->is_stopping)
+                pthread_cond_wait(&yatp_registry.event, &yatp_registry.mutex);
+
+        yatp_registry.n_waiting--;
+
+        if (yatp_registry.n_free > 0) {
+                yatp_registry.n_free--;
+                ret = 1;
+        }
+
+        pthread_mutex_unlock(&yatp_registry.mutex);
+
+        return ret;
+}
+
+static void yatp_token_put (void)
+{
+        pthread_mutex_lock(&yatp_registry.mutex);
+        yatp_registry.n_free++;
+        pthread_cond_signal(&yatp_registry.event);
+        pthread_mutex_unlock(&yatp_registry.mutex);
+}
+
+/*
+ * yatp_token_yield -- gives token up if there is someone waiting for it.
+ * Returns non-zero if token was released.
+ */
+static int yatp_token_yield (void)
+{
+        if (atomic_load_explicit(&yatp_registry.n_waiting,
+                                 memory_order_relaxed) == 0)
+                return 0;
+
+        yatp_token_put();
+
+        return 1;
+}
+
+/*
+ * yatp_wake_helpers -- wakes yatp_help_while callers after task completed
+ * outside of q_mutex (lock-free path)
+ */
+static void yatp_wake_helpers (struct yatp_t *tp)
+{
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (atomic_load_explicit(&tp->n_helpers, memory_order_relaxed)) {
+                pthread_mutex_lock(&tp->q_mutex);
+                pthread_cond_broadcast(&(tp->h_event));
+                pthread_mutex_unlock(&tp->q_mutex);
+        }
+}
+
+/*
+ * yatp_batch_size -- number of tasks worker takes per q_mutex acquisition:
+ * its fair share of queued tasks (up to YATP_BATCH_MAX), but just one if
+ * there are idle workers, so tasks aren't hoarded while others could run
+ * them. Tasks in rings aren't in n_queued (only overflow ones are), so
+ * rings' lengths are added.
+ *
+ * Must be called with q_mutex held.
+ */
+static unsigned int yatp_batch_size (struct yatp_t *tp)
+{
+        struct yatp_group_t *g;
+        unsigned long queued = tp->n_queued;
+        unsigned int k;
+        int i;
+
+        if (atomic_load_explicit(&tp->n_idle, memory_order_relaxed))
+                return 1;
+
+        for (g = tp->groups; g != NULL; g = g->next) {
+                for (i = 0; i < YATP_PRIO_LAST; i++) {
+                        if (g->queue[i]->ring)
+                                queued += yatp_ring_len(g->queue[i]->ring);
+                }
+        }
+
+        k = queued / tp->n_workers;
+
+        if (k > YATP_BATCH_MAX)
+                k = YATP_BATCH_MAX;
+
+        return k ? k : 1;
 }
 
 static void *yatp_worker (void *t)
 {
         struct yatp_t *tp = (struct yatp_t *)t;
-        struct yatp_task_t *task = NULL;
+        struct yatp_task_t *task, rt, batch[YATP_BATCH_MAX];
+        struct yatp_group_t *bg[YATP_BATCH_MAX];
+        unsigned long long bns[YATP_BATCH_MAX];
+        struct timespec next, start, end;
+        unsigned long long r_usage = 0;
+        unsigned long r_done = 0;
+        unsigned int i, k, n = 0;
+        int has_token = 0;
+
+        pthread_mutex_lock(&tp->q_mutex);
+        yatp_self_tp = tp;
+        yatp_self_idx = tp->n_started++;
+        pthread_mutex_unlock(&tp->q_mutex);
 
         for (;;) {
+                if (atomic_load_explicit(&tp->ring_fast, memory_order_relaxed)
+                    && (has_token || !tp->is_registered) && !tp->is_stopping
+                    && yatp_ring_dequeue(tp, &rt) == 0) {
+                        yatp_trace(tp, YATP_TRACE_START, rt.f, rt.arg, rt.prio);
+                        yatp_now(&start);
+                        (rt.f)(rt.arg);
+                        yatp_now(&end);
+                        yatp_trace(tp, YATP_TRACE_END, rt.f, rt.arg, rt.prio);
+
+                        /* root group gets charged once we take q_mutex */
+                        r_usage += yatp_ts_ns(&start, &end);
+                        r_done++;
+
+                        yatp_wake_helpers(tp);
+
+                        if (has_token && yatp_token_yield())
+                                has_token = 0;
+
+                        continue;
+                }
+
                 pthread_mutex_lock(&tp->q_mutex);
 
+                /* charging groups for previous batch */
+                for (i = 0; i < n; i++)
+                        yatp_group_charge(bg[i], bns[i]);
+                n = 0;
+
+                if (r_done) {
+                        yatp_group_account(tp->root, r_usage, r_done);
+                        r_usage = 0;
+                        r_done = 0;
+                }
+
                 if (tp->is_stopping) {
                         pthread_mutex_unlock(&tp->q_mutex);
                         break;
                 }
 
-                task = yatp_dequeue(tp);
+                if (tp->is_registered && !has_token) {
+                        /* token must be obtained before taking task */
+                        if (yatp_pending(tp, &next)) {
+                                pthread_mutex_unlock(&tp->q_mutex);
+                                has_token = yatp_token_get(tp);
+                                continue;
+                        }
+                } else {
+                        /* each task is picked according to policy */
+                        k = yatp_batch_size(tp);
 
-                if (task == NULL) {
-                        pthread_cond_wait(&(tp->q_event), &tp->q_mutex);
-                        task = yatp_dequeue(tp);
+                        while (n < k &&
+                               yatp_dequeue(tp, &next, &batch[n]) == 0)
+                                n++;
+                }
+
+                if (n == 0) {
+                        /* idle worker gives its token up to busy pools */
+                        if (has_token) {
+                                yatp_token_put();
+                                has_token = 0;
+                        }
+
+                        /* throttled tasks are parked till their bucket
+                         * gets refilled */
+                        yatp_idle_wait(tp, &(tp->q_event), &next);
+
+                        if (!tp->is_registered &&
+                            yatp_dequeue(tp, &next, &batch[n]) == 0)
+                                n++;
                 }
 
                 pthread_mutex_unlock(&tp->q_mutex);
 
-                if (task)
+                for (i = 0; i < n; i++) {
+                        task = &batch[i];
+                        yatp_trace(tp, YATP_TRACE_START, task->f, task->arg,
+                                   task->prio);
+                        yatp_now(&start);
                         (task->f)(task->arg);
+                        yatp_now(&end);
+                        yatp_trace(tp, YATP_TRACE_END, task->f, task->arg,
+                                   task->prio);
+
+                        bg[i] = task->group;
+                        bns[i] = yatp_ts_ns(&start, &end);
+                }
 
-                /* XXX: task->arg? */
-                free(task);
+                if (has_token && yatp_token_yield())
+                        has_token = 0;
         }
 
+        if (has_token)
+                yatp_token_put();
+
         return NULL;
 }
 
-int yatp_enqueue (struct yatp_t *tp, void (*f) (void *), void *arg,
-                  enum yatp_prio_t prio)
+int yatp_group_enqueue (struct yatp_group_t *g, void (*f) (void *), void *arg,
+                        enum yatp_prio_t prio)
 {
         int ret = 0;
+        struct yatp_t *tp = g->tp;
+        struct yatp_ring_t *r;
         (void) ret;
 
-        if (tp->is_stopping)
+        if (tp->is_stopping || prio >= YATP_PRIO_LAST)
                 return -1;
 
+        /* lock-free path, unless ring has overflown to the list */
+        r = g->queue[prio]->ring;
+
+        if (r && atomic_load_explicit(&r->overflow, memory_order_relaxed) == 0
+            && yatp_ring_push(r, f, arg) == 0) {
+                yatp_trace(tp, YATP_TRACE_ENQUEUE, f, arg, prio);
+
+                /* pairs with yatp_idle_wait */
+                atomic_thread_fence(memory_order_seq_cst);
+
+                if (atomic_load_explicit(&tp->n_idle, memory_order_relaxed)) {
+                        pthread_mutex_lock(&tp->q_mutex);
+                        pthread_cond_signal(&(tp->q_event));
+                        if (tp->n_helpers)
+                                pthread_cond_signal(&(tp->h_event));
+                        pthread_mutex_unlock(&tp->q_mutex);
+                }
+
+                return 0;
+        }
+
         if (pthread_mutex_lock(&tp->q_mutex) != 0) {
                 fprintf(stderr, "yatp_enqueue: pthread_mutex_lock()\n");
                 return -1;
         }
 
         do {
-                struct yatp_queue_t *q = tp->queue[prio];
+                struct yatp_queue_t *q = g->queue[prio];
                 struct yatp_task_t *t;
 
+                if (g->is_dying) {
+                        ret = -1;
+                        break;
+                }
+
                 t = malloc(sizeof(struct yatp_task_t));
 
                 if (t == NULL) {
@@ -130,8 +887,16 @@ int yatp_enqueue (struct yatp_t *tp, void (*f) (void *), void *arg,
 
                 t->f = f;
                 t->arg = arg;
+                t->prio = prio;
+                t->group = g;
                 t->next = NULL;
 
+                /* group that was idle doesn't get credit for time it
+                 * didn't use */
+                if (g->n_queued == 0 && g->n_running == 0 &&
+                    g->vruntime < tp->min_vruntime)
+                        g->vruntime = tp->min_vruntime;
+
                 if (q->size == 0) {
                         q->first = t;
                         q->last = t;
@@ -141,11 +906,21 @@ int yatp_enqueue (struct yatp_t *tp, void (*f) (void *), void *arg,
                 }
 
                 q->size++;
+                g->n_queued++;
+                tp->n_queued++;
+
+                if (q->ring)
+                        atomic_fetch_add(&q->ring->overflow, 1);
+
+                yatp_trace(tp, YATP_TRACE_ENQUEUE, f, arg, prio);
 
                 if (pthread_cond_signal(&(tp->q_event)) != 0) {
                         fprintf(stderr, "yatp_enqueue: pthread_cond_signal()");
                 }
 
+                if (tp->n_helpers)
+                        pthread_cond_signal(&(tp->h_event));
+
         } while (0);
 
         if (pthread_mutex_unlock(&tp->q_mutex) != 0) {
@@ -155,16 +930,330 @@ int yatp_enqueue (struct yatp_t *tp, void (*f) (void *), void *arg,
         return ret;
 }
 
-int yatp_init (struct yatp_t **tpr, unsigned int n_workers)
+int yatp_enqueue (struct yatp_t *tp, void (*f) (void *), void *arg,
+                  enum yatp_prio_t prio)
+{
+        return yatp_group_enqueue(tp->root, f, arg, prio);
+}
+
+/*
+ * yatp_help_while -- runs pool's tasks in the calling thread till 'done'
+ * returns non-zero. Caller might be a worker (task waiting for its
+ * subtasks) or any other thread, so waiting on a batch doesn't leave CPU
+ * idle and doesn't deadlock when all workers are busy.
+ *
+ * 'done' is called with q_mutex held, so it must not call yatp functions.
+ * Returns -1 if pool is stopping before 'done' becomes true.
+ */
+int yatp_help_while (struct yatp_t *tp, int (*done) (void *), void *ctx)
+{
+        struct yatp_task_t task;
+        struct yatp_group_t *g;
+        struct timespec next, start, end;
+        int ret = 0;
+
+        if (pthread_mutex_lock(&tp->q_mutex) != 0) {
+                fprintf(stderr, "yatp_help_while: pthread_mutex_lock()\n");
+                return -1;
+        }
+
+        /* pairs with yatp_wake_helpers */
+        atomic_fetch_add(&tp->n_helpers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        while (!done(ctx)) {
+                if (tp->is_stopping) {
+                        ret = -1;
+                        break;
+                }
+
+                if (yatp_dequeue(tp, &next, &task)) {
+                        /* waiting for new task or someone's completion */
+                        yatp_idle_wait(tp, &(tp->h_event), &next);
+                        continue;
+                }
+
+                pthread_mutex_unlock(&tp->q_mutex);
+
+                /* task is taken over by thread outside of worker set */
+                if (yatp_self_tp != tp)
+                        yatp_trace(tp, YATP_TRACE_STEAL, task.f, task.arg,
+                                   task.prio);
+
+                g = task.group;
+                yatp_trace(tp, YATP_TRACE_START, task.f, task.arg, task.prio);
+                yatp_now(&start);
+                (task.f)(task.arg);
+                yatp_now(&end);
+                yatp_trace(tp, YATP_TRACE_END, task.f, task.arg, task.prio);
+
+                pthread_mutex_lock(&tp->q_mutex);
+                yatp_group_charge(g, yatp_ts_ns(&start, &end));
+        }
+
+        atomic_fetch_sub(&tp->n_helpers, 1);
+        pthread_mutex_unlock(&tp->q_mutex);
+
+        return ret;
+}
+
+/*
+ * yatp_group_set_rate -- limits rate of group's tasks of given priority to
+ * 'rate' tasks per second with bursts of up to 'burst' tasks. Zero rate
+ * removes the limit.
+ *
+ * Throttled tasks stay queued and don't occupy workers, so tasks of other
+ * priorities (and groups) are still served while bucket is empty.
+ */
+int yatp_group_set_rate (struct yatp_group_t *g, enum yatp_prio_t prio,
+                         unsigned int rate, unsigned int burst)
+{
+        struct yatp_t *tp = g->tp;
+        struct yatp_bucket_t *b;
+
+        if (prio >= YATP_PRIO_LAST)
+                return -1;
+
+        if (pthread_mutex_lock(&tp->q_mutex) != 0) {
+                fprintf(stderr, "yatp_set_rate: pthread_mutex_lock()\n");
+                return -1;
+        }
+
+        b = &g->queue[prio]->bucket;
+
+        if (b->rate && !rate)
+                tp->n_limited--;
+        else if (!b->rate && rate)
+                tp->n_limited++;
+
+        b->rate = rate;
+        b->burst = burst ? burst : 1;
+        b->tokens = b->burst;
+        yatp_now(&b->last);
+        yatp_ring_update(tp);
+
+        /* limit might be relaxed, let sleeping workers re-check queues */
+        pthread_cond_broadcast(&(tp->q_event));
+        pthread_mutex_unlock(&tp->q_mutex);
+
+        return 0;
+}
+
+int yatp_set_rate (struct yatp_t *tp, enum yatp_prio_t prio,
+                   unsigned int rate, unsigned int burst)
+{
+        return yatp_group_set_rate(tp->root, prio, rate, burst);
+}
+
+static struct yatp_group_t *yatp_group_alloc (struct yatp_t *tp,
+                                              unsigned int share, int ring)
+{
+        int i;
+        struct yatp_group_t *g = malloc(sizeof(struct yatp_group_t));
+
+        if (g == NULL)
+                return NULL;
+
+        g->tp = tp;
+        g->share = share ? share : YATP_GROUP_SHARE_DEFAULT;
+        g->n_queued = 0;
+        g->n_running = 0;
+        g->is_dying = 0;
+        g->vruntime = tp->min_vruntime;
+        g->usage = 0;
+        g->n_done = 0;
+        g->next = NULL;
+
+        for (i = 0; i < YATP_PRIO_LAST; i++)
+                g->queue[i] = NULL;
+
+        for (i = 0; i < YATP_PRIO_LAST; i++) {
+                struct yatp_queue_t *q;
+
+                q = malloc(sizeof(struct yatp_queue_t));
+                g->queue[i] = q;
+
+                if (q == NULL) {
+                        yatp_group_free(g);
+                        return NULL;
+                }
+
+                q->prio = i;
+                q->first = NULL;
+                q->last = NULL;
+                q->size = 0;
+                q->in_row = 0;
+                q->bucket.rate = 0;
+                q->bucket.burst = 0;
+                q->bucket.tokens = 0;
+                q->ring = NULL;
+
+                if (ring && (q->ring = yatp_ring_alloc(YATP_RING_SIZE)) == NULL) {
+                        yatp_group_free(g);
+                        return NULL;
+                }
+        }
+
+        return g;
+}
+
+/*
+ * yatp_group_create -- creates task group sharing pool's workers. 'share'
+ * is relative weight of the group (YATP_GROUP_SHARE_DEFAULT if zero).
+ */
+int yatp_group_create (struct yatp_t *tp, struct yatp_group_t **gr,
+                       unsigned int share)
+{
+        struct yatp_group_t *g, *last;
+
+        if (pthread_mutex_lock(&tp->q_mutex) != 0) {
+                fprintf(stderr, "yatp_group_create: pthread_mutex_lock()\n");
+                return -1;
+        }
+
+        g = yatp_group_alloc(tp, share, 0);
+
+        if (g == NULL) {
+                fprintf(stderr, "%s: malloc() failed\n", PROG);
+                pthread_mutex_unlock(&tp->q_mutex);
+                return -1;
+        }
+
+        for (last = tp->groups; last->next != NULL; last = last->next)
+                ;
+        last->next = g;
+        yatp_ring_update(tp);
+
+        pthread_mutex_unlock(&tp->q_mutex);
+
+        *gr = g;
+
+        return 0;
+}
+
+int yatp_group_stats (struct yatp_group_t *g, struct yatp_group_stats_t *st)
+{
+        struct yatp_t *tp = g->tp;
+
+        if (pthread_mutex_lock(&tp->q_mutex) != 0) {
+                fprintf(stderr, "yatp_group_stats: pthread_mutex_lock()\n");
+                return -1;
+        }
+
+        st->share = g->share;
+        st->n_queued = g->n_queued;
+        st->n_running = g->n_running;
+        st->n_done = g->n_done;
+        st->usage_ns = g->usage;
+        st->vruntime = g->vruntime;
+
+        pthread_mutex_unlock(&tp->q_mutex);
+
+        return 0;
+}
+
+/*
+ * yatp_group_destroy -- removes group from the pool, tasks that are still
+ * queued are dropped. If some of group's tasks are running, group is
+ * freed by worker after the last one finishes.
+ */
+int yatp_group_destroy (struct yatp_group_t *g)
+{
+        struct yatp_t *tp = g->tp;
+        struct yatp_group_t **pg;
+        int i;
+
+        if (g == tp->root)
+                return -1;
+
+        if (pthread_mutex_lock(&tp->q_mutex) != 0) {
+                fprintf(stderr, "yatp_group_destroy: pthread_mutex_lock()\n");
+                return -1;
+        }
+
+        for (pg = &tp->groups; *pg != g; pg = &(*pg)->next)
+                ;
+        *pg = g->next;
+
+        for (i = 0; i < YATP_PRIO_LAST; i++) {
+                if (g->queue[i]->bucket.rate)
+                        tp->n_limited--;
+        }
+
+        tp->n_queued -= g->n_queued;
+
+        yatp_ring_update(tp);
+
+        if (g->n_running)
+                g->is_dying = 1;
+        else
+                yatp_group_free(g);
+
+        pthread_mutex_unlock(&tp->q_mutex);
+
+        return 0;
+}
+
+/*
+ * yatp_registry_init -- activates process-wide worker token registry with
+ * 'n_tokens' tokens (number of online CPUs if zero). Pools created after
+ * this call are sharing the tokens. Can be called again to change the
+ * number of tokens.
+ */
+int yatp_registry_init (unsigned int n_tokens)
+{
+        long n = n_tokens;
+
+        if (n == 0)
+                n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (n <= 0)
+                return -1;
+
+        pthread_mutex_lock(&yatp_registry.mutex);
+        yatp_registry.n_free += (int)n - (int)yatp_registry.n_tokens;
+        yatp_registry.n_tokens = n;
+        yatp_registry.is_active = 1;
+        pthread_cond_broadcast(&yatp_registry.event);
+        pthread_mutex_unlock(&yatp_registry.mutex);
+
+        return 0;
+}
+
+/*
+ * yatp_init_flags -- same as yatp_init, 'flags' select optional features:
+ *
+ * - YATP_F_RING: root group's queues are backed by lock-free bounded rings
+ *   (YATP_RING_SIZE tasks per priority), linked lists are only used when
+ *   ring overflows. Tasks are dispatched without taking q_mutex as long as
+ *   there are no other groups and no rate limits.
+ */
+int yatp_init_flags (struct yatp_t **tpr, unsigned int n_workers,
+                     unsigned int flags)
 {
         /* XXX: cleanup on errors */
         int ret, i;
+        pthread_condattr_t attr;
         struct yatp_t *tp = malloc(sizeof(struct yatp_t));
 
         if (tp == NULL)
                 return -1;
 
         tp->is_stopping = 0;
+        tp->flags = flags;
+        tp->n_started = 0;
+        tp->n_queued = 0;
+        atomic_init(&tp->n_helpers, 0);
+        atomic_init(&tp->n_idle, 0);
+        atomic_init(&tp->ring_fast, 0);
+        tp->trace = NULL;
+        atomic_init(&tp->trace_on, 0);
+        tp->n_limited = 0;
+        tp->min_vruntime = 0;
+
+        pthread_mutex_lock(&yatp_registry.mutex);
+        tp->is_registered = yatp_registry.is_active;
+        pthread_mutex_unlock(&yatp_registry.mutex);
         tp->n_workers = n_workers;
         tp->workers = malloc(sizeof(pthread_t)*n_workers);
 
@@ -179,29 +1268,39 @@ int yatp_init (struct yatp_t **tpr, unsigned int n_workers)
                 goto err2;
         }
 
-        if ((ret = pthread_cond_init(&(tp->q_event), NULL)) != 0) {
+        /* Timed waits (rate limiting) are using monotonic clock */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        ret = pthread_cond_init(&(tp->q_event), &attr);
+
+        if (ret != 0) {
+                pthread_condattr_destroy(&attr);
                 fprintf(stderr, "%s: pthread_cond_init() failed with %d\n",
                         PROG, ret);
                 goto err3;
         }
 
-        for (i = 0; i < YATP_PRIO_LAST; i++) {
-                struct yatp_queue_t *q;
+        ret = pthread_cond_init(&(tp->h_event), &attr);
+        pthread_condattr_destroy(&attr);
 
-                q = malloc(sizeof(struct yatp_queue_t));
-                tp->queue[i] = q;
+        if (ret != 0) {
+                fprintf(stderr, "%s: pthread_cond_init() failed with %d\n",
+                        PROG, ret);
+                pthread_cond_destroy(&(tp->q_event));
+                goto err3;
+        }
 
-                if (q == NULL) {
-                        fprintf(stderr, "%s: malloc() failed\n", PROG);
-                        goto err4;
-                }
+        tp->root = yatp_group_alloc(tp, YATP_GROUP_SHARE_DEFAULT,
+                                    flags & YATP_F_RING);
+        tp->groups = tp->root;
 
-                q->prio = i;
-                q->first = NULL;
-                q->last = NULL;
-                q->size = 0;
+        if (tp->root == NULL) {
+                fprintf(stderr, "%s: malloc() failed\n", PROG);
+                goto err4;
         }
 
+        yatp_ring_update(tp);
+
         for (i = 0; i < tp->n_workers; i++) {
                 if ((ret = pthread_create(&(tp->workers[i]), NULL, yatp_worker,
                                           (void *)tp)) != 0) {
@@ -217,13 +1316,9 @@ int yatp_init (struct yatp_t **tpr, unsigned int n_workers)
         return 0;
 
 err4:
-        for (i = 0; i < YATP_PRIO_LAST; i++) {
-                if (tp->queue[i] != NULL) {
-                        free(tp->queue[i]);
-                } else {
-                        break;
-                }
-        }
+        if (tp->root != NULL)
+                yatp_group_free(tp->root);
+        pthread_cond_destroy(&(tp->h_event));
         pthread_cond_destroy(&(tp->q_event));
 err3:
         pthread_mutex_destroy(&(tp->q_mutex));
@@ -235,10 +1330,15 @@ err1:
         return -1;
 }
 
+int yatp_init (struct yatp_t **tpr, unsigned int n_workers)
+{
+        return yatp_init_flags(tpr, n_workers, 0);
+}
+
 int yatp_stop (struct yatp_t *tp)
 {
         int i, err = 0;
-        struct yatp_task_t *task = NULL;
+        struct yatp_group_t *g;
 
         dprintf("%s: shutting down...\n", __func__);
 
@@ -249,7 +1349,8 @@ int yatp_stop (struct yatp_t *tp)
 
         tp->is_stopping = 1;
 
-        if (pthread_cond_broadcast(&(tp->q_event)) != 0) {
+        if (pthread_cond_broadcast(&(tp->q_event)) != 0 ||
+            pthread_cond_broadcast(&(tp->h_event)) != 0) {
                 fprintf(stderr, "yatp_stop: thread_cond_broadcast\n");
                 err = 1;
         }
@@ -259,6 +1360,13 @@ int yatp_stop (struct yatp_t *tp)
                 err = 1;
         }
 
+        /* workers might be waiting for token */
+        if (tp->is_registered) {
+                pthread_mutex_lock(&yatp_registry.mutex);
+                pthread_cond_broadcast(&yatp_registry.event);
+                pthread_mutex_unlock(&yatp_registry.mutex);
+        }
+
         for (i = 0; i < tp->n_workers; i++) {
                 if (pthread_join(tp->workers[i], NULL) != 0) {
                         fprintf(stderr, "yatp_stop: pthread_join\n");
@@ -270,20 +1378,180 @@ int yatp_stop (struct yatp_t *tp)
                 if (tp->workers)
                         free(tp->workers);
 
-                while ((task = yatp_dequeue(tp)) != NULL) {
-                        free(task);
-
-                }
-
-                for (i = 0; i < YATP_PRIO_LAST; i++) {
-                        free(tp->queue[i]);
+                while ((g = tp->groups) != NULL) {
+                        tp->groups = g->next;
+                        yatp_group_free(g);
                 }
 
                 pthread_mutex_destroy(&tp->q_mutex);
                 pthread_cond_destroy(&tp->q_event);
+                pthread_cond_destroy(&tp->h_event);
+
+                if (tp->trace) {
+                        for (i = 0; i <= tp->n_workers; i++)
+                                free(tp->trace[i].ev);
+                        free(tp->trace);
+                }
 
                 free(tp);
         }
 
         return err;
 }
+
+#if YATP_TRACE
+/*
+ * yatp_trace_start -- starts recording of task lifecycle events (enqueue,
+ * dequeue, start, end and steal, i.e. task taken by yatp_help_while from
+ * outside of worker set). Each worker keeps last 'n_events' events
+ * (rounded up to power of two).
+ */
+int yatp_trace_start (struct yatp_t *tp, unsigned int n_events)
+{
+        struct yatp_trace_ring_t *r;
+        unsigned long size = 1;
+        int i;
+
+        while (size < n_events)
+                size <<= 1;
+
+        if (pthread_mutex_lock(&tp->q_mutex) != 0) {
+                fprintf(stderr, "yatp_trace_start: pthread_mutex_lock()\n");
+                return -1;
+        }
+
+        /* rings are kept till yatp_stop, as tracing might still be in
+         * progress in threads that have seen trace_on set */
+        if (tp->trace == NULL) {
+                r = calloc(tp->n_workers + 1, sizeof(struct yatp_trace_ring_t));
+
+                for (i = 0; r != NULL && i <= tp->n_workers; i++) {
+                        r[i].mask = size - 1;
+                        r[i].ev = calloc(size, sizeof(struct yatp_trace_ev_t));
+
+                        if (r[i].ev == NULL) {
+                                while (i--)
+                                        free(r[i].ev);
+                                free(r);
+                                r = NULL;
+                        }
+                }
+
+                if (r == NULL) {
+                        fprintf(stderr, "%s: calloc() failed\n", PROG);
+                        pthread_mutex_unlock(&tp->q_mutex);
+                        return -1;
+                }
+
+                tp->trace = r;
+        }
+
+        /* publishes tp->trace to threads that see trace_on set */
+        atomic_store_explicit(&tp->trace_on, 1, memory_order_release);
+        pthread_mutex_unlock(&tp->q_mutex);
+
+        return 0;
+}
+
+int yatp_trace_stop (struct yatp_t *tp)
+{
+        atomic_store(&tp->trace_on, 0);
+
+        return 0;
+}
+
+static const char *yatp_trace_names[YATP_TRACE_LAST] = {
+        [YATP_TRACE_ENQUEUE] = "enqueue",
+        [YATP_TRACE_DEQUEUE] = "dequeue",
+        [YATP_TRACE_START] = "task",
+        [YATP_TRACE_END] = "task",
+        [YATP_TRACE_STEAL] = "steal",
+};
+
+/*
+ * yatp_trace_dump -- writes recorded events as Chrome trace-event JSON
+ * (chrome://tracing, Perfetto). Events of each thread are shown on its own
+ * track, task execution as duration slices, the rest as instant events.
+ */
+int yatp_trace_dump (struct yatp_t *tp, FILE *fp)
+{
+        struct yatp_trace_ring_t *r;
+        struct yatp_trace_ev_t e;
+        unsigned long head, pos, seq;
+        const char *ph;
+        int i, n = 0;
+        pid_t pid = getpid();
+
+        if (tp->trace == NULL)
+                return -1;
+
+        fprintf(fp, "{\"traceEvents\":[\n");
+
+        for (i = 0; i <= tp->n_workers; i++) {
+                r = &tp->trace[i];
+                head = atomic_load(&r->head);
+                pos = (head > r->mask) ? head - r->mask - 1 : 0;
+
+                for (; pos < head; pos++) {
+                        struct yatp_trace_ev_t *s = &r->ev[pos & r->mask];
+
+                        seq = atomic_load_explicit(&s->seq,
+                                                   memory_order_acquire);
+                        e.ts = s->ts;
+                        e.f = s->f;
+                        e.arg = s->arg;
+                        e.tid = s->tid;
+                        e.type = s->type;
+                        e.prio = s->prio;
+                        atomic_thread_fence(memory_order_acquire);
+
+                        /* being (over)written right now */
+                        if (seq != pos + 1 ||
+                            atomic_load_explicit(&s->seq,
+                                                 memory_order_relaxed) != seq)
+                                continue;
+
+                        switch (e.type) {
+                        case YATP_TRACE_START:
+                                ph = "B";
+                                break;
+                        case YATP_TRACE_END:
+                                ph = "E";
+                                break;
+                        default:
+                                ph = "i";
+                        }
+
+                        fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"yatp\","
+                                "\"ph\":\"%s\",%s\"ts\":%llu.%03llu,"
+                                "\"pid\":%d,\"tid\":%u,\"args\":{"
+                                "\"f\":\"%p\",\"arg\":\"%p\","
+                                "\"prio\":%u,\"worker\":%d}}",
+                                n++ ? ",\n" : "", yatp_trace_names[e.type],
+                                ph, (*ph == 'i') ? "\"s\":\"t\"," : "",
+                                e.ts / 1000, e.ts % 1000, (int)pid, e.tid,
+                                (void *)(size_t)e.f, e.arg, e.prio,
+                                (i < tp->n_workers) ? i : -1);
+                }
+        }
+
+        fprintf(fp, "\n]}\n");
+
+        return ferror(fp) ? -1 : 0;
+}
+#else
+int yatp_trace_start (struct yatp_t *tp, unsigned int n_events)
+{
+        return -1;
+}
+
+int yatp_trace_stop (struct yatp_t *tp)
+{
+        return -1;
+}
+
+int yatp_trace_dump (struct yatp_t *tp, FILE *fp)
+{
+        return -1;
+}
+#endif
@@ -2,6 +2,18 @@
 #define _YATP_H_
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Task lifecycle tracing (see yatp_trace_start). Compiled in unless
+ * YATP_TRACE is defined to 0; when compiled in but not started, it costs
+ * one branch per traced point.
+ */
+#ifndef YATP_TRACE
+#define YATP_TRACE 1
+#endif
 
 enum yatp_prio_t {
         YATP_PRIO_HIGH,
@@ -10,32 +22,170 @@ enum yatp_prio_t {
         YATP_PRIO_LAST
 };
 
+struct yatp_group_t;
+
 struct yatp_task_t {
         void (*f)(void *);
         void *arg;
+        enum yatp_prio_t prio;
+        struct yatp_group_t *group;
         struct yatp_task_t *next;
 };
 
+/*
+ * Token bucket limiting rate of tasks being taken from the queue. 'rate' is
+ * number of tasks per second (0 means unlimited), 'burst' is bucket depth.
+ */
+struct yatp_bucket_t {
+        unsigned int rate;
+        unsigned int burst;
+        double tokens;
+        struct timespec last;
+};
+
+#define YATP_CACHE_LINE 64
+#define YATP_RING_SIZE 1024
+
+/* max number of tasks worker takes per q_mutex acquisition */
+#define YATP_BATCH_MAX 16
+
+/* yatp_init_flags() flags */
+#define YATP_F_RING 0x1
+
+struct yatp_ring_slot_t {
+        _Alignas(YATP_CACHE_LINE) atomic_ulong seq;
+        void (*f)(void *);
+        void *arg;
+};
+
+/*
+ * Lock-free bounded MPMC ring of tasks, (f, arg) are stored inline in
+ * cache line sized slots. 'overflow' is number of tasks in queue's list
+ * (used when ring is full).
+ */
+struct yatp_ring_t {
+        _Alignas(YATP_CACHE_LINE) atomic_ulong head;
+        _Alignas(YATP_CACHE_LINE) atomic_ulong tail;
+        _Alignas(YATP_CACHE_LINE) atomic_uint in_row;
+        atomic_uint overflow;
+        unsigned long mask;
+        struct yatp_ring_slot_t *slots;
+};
+
 struct yatp_queue_t {
         struct yatp_task_t *first;
         struct yatp_task_t *last;
         enum yatp_prio_t prio;
         unsigned int size;
         unsigned int in_row;
+        struct yatp_bucket_t bucket;
+        struct yatp_ring_t *ring;
+};
+
+/*
+ * Task group: set of priority queues sharing pool's workers with other
+ * groups. Groups are picked by virtual runtime (worker time consumed by
+ * group's tasks, scaled by its share), so each group gets portion of
+ * workers proportional to the share. Share of root group (the one used by
+ * yatp_enqueue) is YATP_GROUP_SHARE_DEFAULT.
+ */
+#define YATP_GROUP_SHARE_DEFAULT 1024
+
+struct yatp_group_t {
+        struct yatp_t *tp;
+        struct yatp_queue_t *queue[YATP_PRIO_LAST];
+        unsigned int share;
+        unsigned int n_queued;
+        unsigned int n_running;
+        unsigned int is_dying;
+        unsigned long long vruntime;
+        unsigned long long usage;
+        unsigned long n_done;
+        struct yatp_group_t *next;
+};
+
+struct yatp_group_stats_t {
+        unsigned int share;
+        unsigned int n_queued;
+        unsigned int n_running;
+        unsigned long n_done;
+        unsigned long long usage_ns;
+        unsigned long long vruntime;
+};
+
+enum yatp_trace_type_t {
+        YATP_TRACE_ENQUEUE,
+        YATP_TRACE_DEQUEUE,
+        YATP_TRACE_START,
+        YATP_TRACE_END,
+        YATP_TRACE_STEAL,
+        YATP_TRACE_LAST
+};
+
+struct yatp_trace_ev_t {
+        atomic_ulong seq;
+        unsigned long long ts;
+        void (*f)(void *);
+        void *arg;
+        unsigned int tid;
+        unsigned char type;
+        unsigned char prio;
+};
+
+/*
+ * Ring of trace events, older events are overwritten. Each worker has its
+ * own ring, threads that aren't pool's workers share extra one.
+ */
+struct yatp_trace_ring_t {
+        atomic_ulong head;
+        unsigned long mask;
+        struct yatp_trace_ev_t *ev;
 };
 
 struct yatp_t {
         unsigned int n_workers;
+        unsigned int n_started;
+        unsigned int n_queued;
         pthread_t *workers;
         pthread_mutex_t q_mutex;
         pthread_cond_t q_event;
+        pthread_cond_t h_event;
         unsigned int is_stopping;
-        struct yatp_queue_t *queue[YATP_PRIO_LAST];
+        unsigned int flags;
+        atomic_uint n_helpers;
+        atomic_uint n_idle;
+        atomic_uint ring_fast;
+        unsigned int is_registered;
+        unsigned int n_limited;
+        unsigned long long min_vruntime;
+        struct yatp_group_t *root;
+        struct yatp_group_t *groups;
+        atomic_uint trace_on;
+        struct yatp_trace_ring_t *trace;
 };
 
+int yatp_registry_init (unsigned int n_tokens);
 int yatp_init (struct yatp_t **tpr, unsigned int n_workers);
+int yatp_init_flags (struct yatp_t **tpr, unsigned int n_workers,
+                     unsigned int flags);
 int yatp_enqueue (struct yatp_t *tp, void (*f) (void *), void *arg,
                   enum yatp_prio_t prio);
+int yatp_set_rate (struct yatp_t *tp, enum yatp_prio_t prio,
+                   unsigned int rate, unsigned int burst);
+int yatp_help_while (struct yatp_t *tp, int (*done) (void *), void *ctx);
 int yatp_stop (struct yatp_t *tp);
 
+int yatp_trace_start (struct yatp_t *tp, unsigned int n_events);
+int yatp_trace_stop (struct yatp_t *tp);
+int yatp_trace_dump (struct yatp_t *tp, FILE *fp);
+
+int yatp_group_create (struct yatp_t *tp, struct yatp_group_t **gr,
+                       unsigned int share);
+int yatp_group_enqueue (struct yatp_group_t *g, void (*f) (void *), void *arg,
+                        enum yatp_prio_t prio);
+int yatp_group_set_rate (struct yatp_group_t *g, enum yatp_prio_t prio,
+                         unsigned int rate, unsigned int burst);
+int yatp_group_stats (struct yatp_group_t *g, struct yatp_group_stats_t *st);
+int yatp_group_destroy (struct yatp_group_t *g);
+
 #endif
\ No newline at end of file
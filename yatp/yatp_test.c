@@ -1,8 +1,527 @@
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "yatp.h"
 
+#define check(cond)                                                     \
+        do {                                                            \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: check failed: %s\n",    \
+                                __FILE__, __LINE__, #cond);             \
+                        exit(EXIT_FAILURE);                             \
+                }                                                       \
+        } while (0)
+
+static double now_sec (void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_task (void *arg)
+{
+        atomic_fetch_add((atomic_uint *)arg, 1);
+}
+
+/* wait_for -- waits till counter reaches 'n', returns 0 on timeout */
+static int wait_for (atomic_uint *c, unsigned int n, double timeout)
+{
+        double end = now_sec() + timeout;
+
+        while (atomic_load(c) < n) {
+                if (now_sec() > end)
+                        return 0;
+                usleep(1000);
+        }
+
+        return 1;
+}
+
+/*
+ * test_rate -- throttled priority runs at its rate (burst on top), keeps its
+ * limit after queue drains, other priorities aren't held back, and zero
+ * rate removes the limit
+ */
+static void test_rate (void)
+{
+        struct yatp_t *tp;
+        atomic_uint n, h;
+        double start;
+        int i;
+
+        atomic_init(&n, 0);
+        atomic_init(&h, 0);
+
+        check(yatp_init(&tp, 2) == 0);
+        check(yatp_set_rate(tp, YATP_PRIO_NORMAL, 50, 5) == 0);
+
+        start = now_sec();
+
+        for (i = 0; i < 50; i++)
+                check(yatp_enqueue(tp, count_task, &n, YATP_PRIO_NORMAL) == 0);
+
+        for (i = 0; i < 10; i++)
+                check(yatp_enqueue(tp, count_task, &h, YATP_PRIO_HIGH) == 0);
+
+        check(wait_for(&h, 10, 0.2));
+
+        usleep(500000);
+
+        /* burst plus rate * elapsed, with slack for scheduling */
+        check(atomic_load(&n) <= 5 + 50 * (now_sec() - start) + 2);
+        check(atomic_load(&n) >= 15);
+
+        check(wait_for(&n, 50, 2.0));
+
+        /* queue has drained, limit still applies */
+        start = now_sec();
+
+        for (i = 0; i < 20; i++)
+                check(yatp_enqueue(tp, count_task, &n, YATP_PRIO_NORMAL) == 0);
+
+        usleep(200000);
+        check(atomic_load(&n) - 50 <= 5 + 50 * (now_sec() - start) + 2);
+        check(atomic_load(&n) < 70);
+
+        check(yatp_set_rate(tp, YATP_PRIO_NORMAL, 0, 0) == 0);
+        check(wait_for(&n, 70, 0.2));
+
+        check(yatp_stop(tp) == 0);
+}
+
+static void spin_task (void *arg)
+{
+        double end = now_sec() + 0.001;
+
+        while (now_sec() < end)
+                ;
+
+        if (arg)
+                atomic_fetch_add((atomic_uint *)arg, 1);
+}
+
+/*
+ * test_groups -- backlogged groups get worker time in proportion to their
+ * shares. Time is compared rather than tasks done (spin_task takes longer
+ * once worker gets preempted), over long enough run for batches (taken from
+ * one group before it's charged) not to skew it.
+ */
+static void test_groups (void)
+{
+        struct yatp_group_stats_t s1, s3;
+        struct yatp_group_t *g1, *g3;
+        struct yatp_t *tp;
+        double ratio;
+        int i;
+
+        check(yatp_init(&tp, 1) == 0);
+        check(yatp_group_create(tp, &g1, 1024) == 0);
+        check(yatp_group_create(tp, &g3, 3072) == 0);
+
+        for (i = 0; i < 1000; i++) {
+                check(yatp_group_enqueue(g1, spin_task, NULL,
+                                         YATP_PRIO_NORMAL) == 0);
+                check(yatp_group_enqueue(g3, spin_task, NULL,
+                                         YATP_PRIO_NORMAL) == 0);
+        }
+
+        /* both groups stay backlogged meanwhile */
+        usleep(600000);
+
+        check(yatp_group_stats(g1, &s1) == 0);
+        check(yatp_group_stats(g3, &s3) == 0);
+
+        check(s1.share == 1024 && s3.share == 3072);
+        check(s1.n_queued && s3.n_queued);
+        check(s1.n_done > 10);
+
+        ratio = (double)s3.usage_ns / s1.usage_ns;
+        check(ratio > 2.0 && ratio < 4.5);
+
+        /* queued tasks are dropped */
+        check(yatp_group_destroy(g1) == 0);
+        check(yatp_group_destroy(g3) == 0);
+        check(yatp_stop(tp) == 0);
+}
+
+struct help_ctx {
+        struct yatp_t *tp;
+        atomic_uint n;
+        atomic_uint done;
+        int ret;
+};
+
+static int help_done (void *arg)
+{
+        return atomic_load(&((struct help_ctx *)arg)->n) == 8;
+}
+
+static void help_parent (void *arg)
+{
+        struct help_ctx *c = arg;
+        int i;
+
+        for (i = 0; i < 8; i++)
+                yatp_enqueue(c->tp, spin_task, &c->n, YATP_PRIO_NORMAL);
+
+        c->ret = yatp_help_while(c->tp, help_done, c);
+        atomic_store(&c->done, 1);
+}
+
+/*
+ * test_help_while -- task waiting for its subtasks on a single-worker pool
+ * runs them itself instead of deadlocking
+ */
+static void test_help_while (void)
+{
+        struct help_ctx c;
+
+        atomic_init(&c.n, 0);
+        atomic_init(&c.done, 0);
+        c.ret = -1;
+
+        check(yatp_init(&c.tp, 1) == 0);
+        check(yatp_enqueue(c.tp, help_parent, &c, YATP_PRIO_NORMAL) == 0);
+
+        check(wait_for(&c.done, 1, 1.0));
+        check(c.ret == 0);
+        check(atomic_load(&c.n) == 8);
+
+        check(yatp_stop(c.tp) == 0);
+}
+
+static atomic_uint gate_open, gate_in;
+
+/* gate_task -- keeps worker busy till gate_open is set */
+static void gate_task (void *arg)
+{
+        atomic_store(&gate_in, 1);
+
+        while (!atomic_load(&gate_open))
+                usleep(1000);
+}
+
+/* gate_pool -- blocks the only worker of pool 'tp' */
+static void gate_pool (struct yatp_t *tp)
+{
+        atomic_store(&gate_open, 0);
+        atomic_store(&gate_in, 0);
+
+        check(yatp_enqueue(tp, gate_task, NULL, YATP_PRIO_NORMAL) == 0);
+        check(wait_for(&gate_in, 1, 1.0));
+}
+
+#define RING_N (YATP_RING_SIZE + 100)
+
+static unsigned int ord[RING_N];
+static atomic_uint ord_n;
+
+static void ord_task (void *arg)
+{
+        ord[atomic_fetch_add(&ord_n, 1)] = (size_t)arg;
+}
+
+/*
+ * test_ring -- tasks that don't fit into the ring go to overflow list and
+ * all of them run once, in FIFO order
+ */
+static void test_ring (void)
+{
+        struct yatp_t *tp;
+        int i;
+
+        atomic_init(&ord_n, 0);
+
+        check(yatp_init_flags(&tp, 1, YATP_F_RING) == 0);
+        gate_pool(tp);
+
+        for (i = 0; i < RING_N; i++)
+                check(yatp_enqueue(tp, ord_task, (void *)(size_t)i,
+                                   YATP_PRIO_NORMAL) == 0);
+
+        check(atomic_load(&tp->root->queue[YATP_PRIO_NORMAL]->ring->overflow)
+              == 100);
+
+        atomic_store(&gate_open, 1);
+        check(wait_for(&ord_n, RING_N, 2.0));
+
+        for (i = 0; i < RING_N; i++)
+                check(ord[i] == (unsigned int)i);
+
+        check(atomic_load(&tp->root->queue[YATP_PRIO_NORMAL]->ring->overflow)
+              == 0);
+        check(yatp_stop(tp) == 0);
+}
+
+#define STRESS_TRICKLE 1000
+#define STRESS_BURST 100000
+#define STRESS_HELPERS 2
+
+static struct yatp_t *stress_tp;
+static atomic_uint stress_n;
+
+static int stress_done (void *arg)
+{
+        return atomic_load(&stress_n) >= STRESS_BURST;
+}
+
+static void *stress_helper (void *arg)
+{
+        *(int *)arg = yatp_help_while(stress_tp, stress_done, NULL);
+
+        return NULL;
+}
+
+/*
+ * test_ring_stress -- ring tasks pushed one at a time wake idle workers,
+ * and helpers and workers on locked path run ring tasks alongside
+ * lock-free consumers without losing (or double running) any of them
+ */
+static void test_ring_stress (void)
+{
+        pthread_t th[STRESS_HELPERS];
+        int ret[STRESS_HELPERS];
+        int i;
+
+        atomic_init(&stress_n, 0);
+
+        check(yatp_init_flags(&stress_tp, 4, YATP_F_RING) == 0);
+
+        for (i = 0; i < STRESS_TRICKLE; i++) {
+                check(yatp_enqueue(stress_tp, count_task, &stress_n,
+                                   i % YATP_PRIO_LAST) == 0);
+                check(wait_for(&stress_n, i + 1, 1.0));
+        }
+
+        atomic_store(&stress_n, 0);
+
+        for (i = 0; i < STRESS_HELPERS; i++)
+                check(pthread_create(&th[i], NULL, stress_helper, &ret[i])
+                      == 0);
+
+        for (i = 0; i < STRESS_BURST; i++)
+                check(yatp_enqueue(stress_tp, count_task, &stress_n,
+                                   i % YATP_PRIO_LAST) == 0);
+
+        check(wait_for(&stress_n, STRESS_BURST, 10.0));
+
+        for (i = 0; i < STRESS_HELPERS; i++) {
+                pthread_join(th[i], NULL);
+                check(ret[i] == 0);
+        }
+
+        check(yatp_stop(stress_tp) == 0);
+        check(atomic_load(&stress_n) == STRESS_BURST);
+}
+
+/*
+ * test_batch -- tasks taken in a batch still follow priority policy (three
+ * high prio'd in a row, then normal one), and a worker with backlog takes
+ * YATP_BATCH_MAX of them per q_mutex acquisition, with ring backend too (idle
+ * group keeps pool off lock-free path)
+ */
+static void test_batch (unsigned int flags)
+{
+        struct yatp_group_t *g = NULL;
+        struct yatp_t *tp;
+        int i;
+
+        atomic_init(&ord_n, 0);
+
+        check(yatp_init_flags(&tp, 1, flags) == 0);
+        if (flags & YATP_F_RING)
+                check(yatp_group_create(tp, &g, 1024) == 0);
+#if YATP_TRACE
+        check(yatp_trace_start(tp, 256) == 0);
+#endif
+        gate_pool(tp);
+
+        for (i = 0; i < 20; i++) {
+                check(yatp_enqueue(tp, ord_task, (void *)YATP_PRIO_HIGH,
+                                   YATP_PRIO_HIGH) == 0);
+                check(yatp_enqueue(tp, ord_task, (void *)YATP_PRIO_NORMAL,
+                                   YATP_PRIO_NORMAL) == 0);
+        }
+
+        atomic_store(&gate_open, 1);
+        check(wait_for(&ord_n, 40, 1.0));
+
+        for (i = 0; i < 20; i++)
+                check(ord[i] == (i % 4 == 3 ? YATP_PRIO_NORMAL
+                                            : YATP_PRIO_HIGH));
+
+#if YATP_TRACE
+        {
+                struct yatp_trace_ring_t *r = &tp->trace[0];
+                unsigned long pos, head = atomic_load(&r->head);
+                unsigned int run = 0, max_run = 0;
+
+                check(head <= r->mask + 1);
+
+                for (pos = 0; pos < head; pos++) {
+                        if (r->ev[pos].type == YATP_TRACE_DEQUEUE)
+                                run++;
+                        else
+                                run = 0;
+
+                        if (run > max_run)
+                                max_run = run;
+                }
+
+                check(max_run == YATP_BATCH_MAX);
+        }
+#endif
+
+        if (g)
+                check(yatp_group_destroy(g) == 0);
+        check(yatp_stop(tp) == 0);
+}
+
+#if YATP_TRACE
+/* count_str -- number of occurrences of 'pat' in 's' */
+static int count_str (const char *s, const char *pat)
+{
+        int n = 0;
+
+        while ((s = strstr(s, pat)) != NULL) {
+                n++;
+                s++;
+        }
+
+        return n;
+}
+
+/* json_balanced -- brackets and braces outside of strings match */
+static int json_balanced (const char *s)
+{
+        char st[64];
+        int depth = 0, in_str = 0;
+
+        for (; *s; s++) {
+                if (in_str) {
+                        if (*s == '\\' && s[1])
+                                s++;
+                        else if (*s == '"')
+                                in_str = 0;
+                } else if (*s == '"') {
+                        in_str = 1;
+                } else if (*s == '{' || *s == '[') {
+                        if (depth == sizeof(st))
+                                return 0;
+                        st[depth++] = *s == '{' ? '}' : ']';
+                } else if (*s == '}' || *s == ']') {
+                        if (depth == 0 || st[--depth] != *s)
+                                return 0;
+                }
+        }
+
+        return depth == 0 && !in_str;
+}
+
+/*
+ * test_trace -- dump is well-formed trace-event JSON with an enqueue,
+ * dequeue and a start/end slice per task
+ */
+static void test_trace (void)
+{
+        struct yatp_t *tp;
+        atomic_uint n;
+        char *buf;
+        FILE *fp;
+        long len;
+        int i;
+
+        atomic_init(&n, 0);
+
+        check(yatp_init(&tp, 2) == 0);
+        check(yatp_trace_start(tp, 1024) == 0);
+
+        for (i = 0; i < 20; i++)
+                check(yatp_enqueue(tp, count_task, &n, YATP_PRIO_NORMAL) == 0);
+
+        check(wait_for(&n, 20, 1.0));
+        /* END is recorded after task returns */
+        usleep(50000);
+        check(yatp_trace_stop(tp) == 0);
+
+        check((fp = tmpfile()) != NULL);
+        check(yatp_trace_dump(tp, fp) == 0);
+        len = ftell(fp);
+        rewind(fp);
+
+        check((buf = calloc(1, len + 1)) != NULL);
+        check(fread(buf, 1, len, fp) == (size_t)len);
+        fclose(fp);
+
+        check(strncmp(buf, "{\"traceEvents\":[", 16) == 0);
+        check(len > 3 && strcmp(buf + len - 3, "]}\n") == 0);
+        check(json_balanced(buf));
+
+        check(count_str(buf, "\"name\":\"enqueue\"") == 20);
+        check(count_str(buf, "\"name\":\"dequeue\"") == 20);
+        check(count_str(buf, "\"ph\":\"B\"") == 20);
+        check(count_str(buf, "\"ph\":\"E\"") == 20);
+
+        free(buf);
+        check(yatp_stop(tp) == 0);
+}
+#endif
+
+static atomic_uint reg_running, reg_max;
+
+static void reg_task (void *arg)
+{
+        unsigned int r = atomic_fetch_add(&reg_running, 1) + 1;
+        unsigned int m = atomic_load(&reg_max);
+
+        while (r > m && !atomic_compare_exchange_weak(&reg_max, &m, r))
+                ;
+
+        spin_task(NULL);
+        atomic_fetch_sub(&reg_running, 1);
+        atomic_fetch_add((atomic_uint *)arg, 1);
+}
+
+/*
+ * test_registry -- pools created after yatp_registry_init never run more
+ * tasks at once than there are tokens, and all of them make progress.
+ * Registry is process-wide, so this goes last.
+ */
+static void test_registry (void)
+{
+        struct yatp_t *tp1, *tp2;
+        atomic_uint n1, n2;
+        int i;
+
+        atomic_init(&n1, 0);
+        atomic_init(&n2, 0);
+
+        check(yatp_registry_init(2) == 0);
+        check(yatp_init(&tp1, 3) == 0);
+        check(yatp_init(&tp2, 3) == 0);
+
+        for (i = 0; i < 100; i++) {
+                check(yatp_enqueue(tp1, reg_task, &n1, YATP_PRIO_NORMAL) == 0);
+                check(yatp_enqueue(tp2, reg_task, &n2, YATP_PRIO_NORMAL) == 0);
+        }
+
+        check(wait_for(&n1, 100, 5.0));
+        check(wait_for(&n2, 100, 5.0));
+
+        /* 6 workers, 2 tokens */
+        check(atomic_load(&reg_max) <= 2);
+
+        check(yatp_stop(tp1) == 0);
+        check(yatp_stop(tp2) == 0);
+}
+
 void dumb_task(void *arg) {
         int t = (size_t) arg;
         printf("Task %d: started, timeout = %d, priority = %d\n",
@@ -16,6 +535,17 @@ int main (int argc, char **argv)
 {
         struct yatp_t *tp;
 
+        test_rate();
+        test_groups();
+        test_help_while();
+        test_ring();
+        test_ring_stress();
+        test_batch(0);
+        test_batch(YATP_F_RING);
+#if YATP_TRACE
+        test_trace();
+#endif
+
         yatp_init(&tp, 4);
 
         yatp_enqueue(tp, dumb_task,
@@ -67,5 +597,7 @@ int main (int argc, char **argv)
 
         yatp_stop(tp);
 
+        test_registry();
+
         return 0;
 }